@@ -1,5 +1,6 @@
 // gstream.cpp - FINAL CLEAN VERSION - compiles on ALL Linux (x86_64, aarch64, armhf, etc.)
 // Works at 250000 baud everywhere, with feedrate/bed/hotend override + bulletproof resend handling
+// Build: g++ -std=c++20 -O2 -pthread MarlinEnder3Streamer.cpp -o gstream   (GCC 10+, C++20 coroutines)
 
 #include <iostream>
 #include <fstream>
@@ -11,14 +12,108 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <chrono>
+#include <deque>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <filesystem>
+#include <sstream>
 #include <iomanip>
 #include <cstdlib>
+#include <cmath>
+#include <charconv>
+#include <sys/stat.h>
+#include <string_view>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sysmacros.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <tuple>
+#include <map>
+#include <array>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <memory>
+#include <unordered_map>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#else
+#define HAVE_IO_URING 0
+#endif
+
+// A decimal as written: "1234.50" is {123450, 2}. Scaling it in integers keeps
+// the input's precision and never goes through double or a locale.
+struct Decimal {
+    long long mant = 0;
+    int decimals = 0;
+};
+
+// At most 12 digits, so mant × a 6-digit factor can't overflow
+bool parse_decimal(const char* p, const char* end, Decimal& d) {
+    bool neg = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    long long m = 0;
+    int digits = 0, dec = -1;
+    for (; p < end; ++p) {
+        if (*p == '.' && dec < 0) { dec = 0; continue; }
+        if (*p < '0' || *p > '9' || digits == 12) return false;
+        m = m * 10 + (*p - '0');
+        digits++;
+        if (dec >= 0) dec++;
+    }
+    if (!digits) return false;
+    d.mant = neg ? -m : m;
+    d.decimals = std::max(dec, 0);
+    return true;
+}
+
+struct MachineLimits {
+    double min[3] = { 0, 0, 0 };
+    double max[3] = { 235, 235, 250 };   // stock Ender 3: X_BED_SIZE, Y_BED_SIZE, Z_MAX_POS
+    double max_feedrate = 30000;         // mm/min — DEFAULT_MAX_FEEDRATE X/Y 500 mm/s
+    int max_hotend = 260;                // HEATER_0_MAXTEMP 275 minus Marlin's 15° margin
+    int max_bed = 110;                   // BED_MAXTEMP 125 minus 15°
+};
 
 struct Overrides {
     int feedrate_percent = -1;   // -1 = no override
     int bed_temp = -1;
     int hotend_temp = -1;
+    Decimal flow_percent;        // E multiplier, {0, 0} = no override
+    Decimal z_offset;            // added to absolute Z
+    int window = 1;              // commands in flight before waiting for an ok
+    int temp_poll_s = 0;         // M105 interval while printing, 0 = off
+    double jitter_ms = 0;        // gap report threshold, 0 = no gap report
+    bool preflight = false;      // validate each job before sending it
+    int fast_start = 0;          // commands the start-sequence optimizer looks at, 0 = off
+    bool stored_mesh = false;    // G29 → M420 S1 in the start sequence
+    double park[3] = { 0, 220, 10 };   // pause: park X and Y, and how far Z goes up
+    double pause_retract = 5;    // pause: mm of filament pulled back
+    double heat_settle = 0;      // M109/M190 held on the host until this many s stable, 0 = off
+    std::string temp_log;        // where to save the job's temperature samples, "" = nowhere
+    std::vector<std::string> stages;   // transform pipeline, in command-line order
+    MachineLimits limits;
     bool debug = false;
 };
 
@@ -28,12 +123,76 @@ MarlinEnder3Streamer.cpp - Ultimate Marlin Ender3 G-code streamer
 Works on x86_64, aarch64, Raspberry Pi, Orange Pi — everywhere!
 
 Usage:
-  )" << prog << R"( /dev/ttyUSB0 115200 file.gcode [options]
+  )" << prog << R"( /dev/ttyUSB0 115200 file.gcode [more.gcode ...] [options]
+  )" << prog << R"( /dev/ttyUSB0 115200 --daemon=/run/ender3.sock [options]
+  )" << prog << R"( /dev/ttyUSB0 115200 --selftest  latency, throughput and resends at every baud rate
+  )" << prog << R"( sim 115200 file.gcode [options]    stream to a simulated Ender 3 (planner, buffers,
+                      move times) and report where its planner ran empty
+  )" << prog << R"( tcp://host:2000 115200 file.gcode  through a ser2net-style TCP bridge
+  )" << prog << R"( null 115200 file.gcode   no printer: every line acked at once (host-side timing)
+  )" << prog << R"( --ctl=/run/ender3.sock STATUS | SUBMIT file.gcode | PAUSE | RESUME | CANCEL [id] | SHUTDOWN
+  )" << prog << R"( --shm-read /ender3 [seconds]  show the status an --shm streamer publishes
+  )" << prog << R"( --bench-io [commands]    compare I/O backends on 1/8/32 simulated printers
+  )" << prog << R"( --bench-scan [file.gcode]  time the line scanner on each SIMD ISA
+  )" << prog << R"( --check file.gcode [more.gcode ...] [options]  pre-flight check only, no printer
+  )" << prog << R"( --compile file.gcode out.gir  save the parsed IR; .gir files print without parsing
+  )" << prog << R"( --bench-ir [file.gcode]    IR size and re-serialization speed against text
 
 Options:
-  --feedrate=120      Multiply all F values by 120%
+  --feedrate=120      Multiply all F values by 120% (1 to 1000)
   --bed=65            Force bed to 65°C
   --hotend=215        Force hotend to 215°C
+  --flow=95           Multiply all E values (moves and G92) by 95% (1 to 1000)
+  --z-offset=-0.05    Add this to every absolute Z move, in mm (G92 is left as is)
+  --window=1          Commands in flight before waiting for an ok (Marlin BUFSIZE is 4)
+  --temp-poll=0       Ask for temperatures (M105) every N seconds while printing
+  --jitter[=50]       Time every inter-command gap, flag gaps over N ms with the
+                      file line and what the host was doing, report percentiles
+  --queue-dir=DIR     After the listed files, print every .gcode in DIR by name
+                      (rescanned after each job, so new files get picked up)
+  --between=FILE      G-code to run between jobs, e.g. a bed-clear macro
+  --daemon=SOCK       Stay connected and take jobs over a Unix socket
+                      (SUBMIT path | STATUS | PAUSE | RESUME | CANCEL [id] | SHUTDOWN)
+  --idle-poll=10      Seconds between M105 health checks while idle (daemon)
+  --io=uring          io_uring serial I/O (default: plain read/write)
+  --metrics=PATH      Write counters for node_exporter's textfile collector
+  --metrics-interval=15
+                      Seconds between metrics file updates
+  --shm=/ender3       Publish live status (line, layer, temps, window, ETA) in
+                      shared memory for --shm-read, dashboards and other tools
+  --rt=50             Real-time mode: SCHED_FIFO at this priority, memory locked,
+                      scheduling latency reported per job (needs CAP_SYS_NICE)
+  --cpus=2,3          Pin the serial thread to these CPUs (with --rt)
+  --aux-cpus=0-1      CPUs for helper threads such as the control socket
+  --auto-baud         Step baud down on a noisy link, back up once it is clean
+  --link-window=60    Seconds of history the link monitor looks at
+  --link-errors=5     Errors inside the window that trigger a step-down
+  --link-clean=300    Error-free seconds before stepping back up
+  --preflight         Check each file before sending it (syntax, unknown commands,
+                      build volume, feedrates and temperatures after overrides);
+                      a file with errors is not printed
+  --check             Only run the pre-flight check on the files, don't connect
+  --volume=235x235x250
+                      Build volume for the pre-flight check, in mm
+  --fast-start[=50]   Rewrite the start G-code in the first N commands: heat bed and
+                      hotend together, drop repeated G28; reports the time saved
+  --stored-mesh       With --fast-start: replace G29 by M420 S1 (mesh in EEPROM)
+  --dedupe            Drop commands that change nothing (repeated F, fan and heater
+                      values, zero-length moves); reports the ok round-trips saved
+                      --feedrate, --bed/--hotend, --flow, --z-offset and --dedupe
+                      transform the G-code in the order they are given
+  --sim-bufsize=4     With "sim" as the device: Marlin's BUFSIZE ...
+  --sim-blocks=16     ... and BLOCK_BUFFER_SIZE for the simulated printer
+  --fast-clock        Run "sim" in-process on a virtual clock: no pty, no waiting,
+                      a long print is simulated in seconds with the same timing
+  --park=0,220,10     Pause (SIGUSR1, Ctrl-Z, PAUSE) parks the head at this X, Y
+                      and lifts Z this much; SIGUSR2, Ctrl-Z or RESUME resumes
+  --pause-retract=5   Filament pulled back while paused, in mm
+  --heat-settle[=3]   Send M109/M190 as M104/M140 and wait on the host until the
+                      heater has held within 1° of target for N s, instead of
+                      Marlin's 10 s residency; reports the time saved
+  --temp-log=PATH     Save the job's temperature reports (M155 S1 auto-reports
+                      where the firmware has them) at its end: CSV for .csv, else binary
   --debug             Show all comms
   --help              This help
 
@@ -42,6 +201,10 @@ Example:
 )";
 }
 
+// Every rate get_baud_constant() accepts, slowest first — the auto-baud ladder
+const int BAUD_RATES[] = { 9600, 19200, 38400, 57600, 115200, 230400, 250000, 460800, 500000, 921600, 1000000 };
+const int NUM_BAUD_RATES = sizeof(BAUD_RATES) / sizeof(BAUD_RATES[0]);
+
 speed_t get_baud_constant(int baud) {
     switch (baud) {
         case 9600:    return B9600;
@@ -73,174 +236,5287 @@ int set_serial(int fd, int baud) {
     tty.c_cflag |= (CLOCAL | CREAD);
     tty.c_cflag &= ~CRTSCTS;
     tty.c_cc[VMIN] = 0;
-    tty.c_cc[VTIME] = 20;
+    tty.c_cc[VTIME] = 0;         // read_line() waits in poll() so short timeouts work
 
     if (tcsetattr(fd, TCSANOW, &tty) != 0) return -1;
     tcflush(fd, TCIOFLUSH);
     return 0;
 }
 
-std::string read_line(int fd) {
-    std::string s;
+// ---- Clock ---------------------------------------------------------------------
+// Protocol timing — timeouts, waits, ack latencies, gap and link statistics —
+// reads host_clock, not steady_clock. That is the real clock, except for
+// "sim" with --fast-clock: then it is a VirtualClock that the simulated printer
+// shares. Nothing sleeps; time jumps to whatever either side waits for next,
+// so a 20-hour print runs at CPU speed with the timing it would have had.
+// CPU-time measurements (pre-flight, benchmarks) stay on steady_clock.
+
+class HostClock {
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+    using duration = std::chrono::steady_clock::duration;
+    virtual ~HostClock() = default;
+    virtual time_point now() { return std::chrono::steady_clock::now(); }
+    virtual void sleep_for(duration d) { std::this_thread::sleep_for(d); }
+};
+
+class VirtualClock : public HostClock {
+public:
+    time_point now() override { return t; }
+    void sleep_for(duration d) override { t += d; }
+    void advance_to(time_point to) { t = std::max(t, to); }
+private:
+    time_point t = std::chrono::steady_clock::now();
+};
+
+HostClock real_clock;
+HostClock* host_clock = &real_clock;   // set once in main, before any thread starts
+
+// steady_clock's interface over host_clock, for code that names a clock type
+struct SessionClock {
+    using duration = HostClock::duration;
+    using time_point = HostClock::time_point;
+    static time_point now() { return host_clock->now(); }
+};
+
+long io_syscalls = 0;   // read()/write()/poll()/io_uring_enter() on the printer side, for --bench-io
+
+// Reads into s until a full line is there (true) or timeout_ms passes (false).
+// A partial line stays in s for the next call.
+bool read_line(int fd, std::string& s, int timeout_ms) {
     char ch;
-    auto start = std::chrono::steady_clock::now();
+    auto start = SessionClock::now();
     while (true) {
+        io_syscalls++;
         ssize_t n = read(fd, &ch, 1);
         if (n > 0) {
             if (ch == '\n') {
                 if (!s.empty() && s.back() == '\r') s.pop_back();
-                return s;
+                return true;
             }
             if (ch != '\r') s += ch;
-        } else if (n == 0) {
-            if (std::chrono::steady_clock::now() - start > std::chrono::seconds(10))
-                return "";
-            usleep(5000);
+        } else {   // nothing yet, or an error such as EIO from a pty with no other end
+            auto left = std::chrono::milliseconds(timeout_ms) - (SessionClock::now() - start);
+            if (left <= std::chrono::milliseconds(0)) return false;
+            struct pollfd pfd{ fd, POLLIN, 0 };
+            io_syscalls++;
+            poll(&pfd, 1, int(std::chrono::duration_cast<std::chrono::milliseconds>(left).count()) + 1);
         }
     }
 }
 
-void emergency_reset(int fd, bool debug) {
-    std::cout << "\nFORCING HARD RESET (M112 + M999)\n";
-    write(fd, "M112\nM999\n", 11);
-    usleep(4000000);
-    tcflush(fd, TCIOFLUSH);
-    std::cout << "Printer rebooted — fresh start\n\n";
+std::string read_line(int fd, int timeout_ms = 10000) {
+    std::string s;
+    return read_line(fd, s, timeout_ms) ? s : "";
 }
 
-void trim(std::string& s) {
-    s.erase(0, s.find_first_not_of(" \t\r\n"));
-    s.erase(s.find_last_not_of(" \t\r\n") + 1);
-}
+// ---- Serial I/O backends -----------------------------------------------------
+// Everything that talks to the printer goes through a SerialIo. PlainIo is the
+// original path (write() per line, read() per byte in read_line()); UringIo
+// keeps a multishot read posted on the tty and batches writes into the next
+// io_uring_enter(), so a whole command round trip costs one syscall.
+
+struct SerialIo {
+    int fd = -1;
+    virtual ~SerialIo() = default;
+    virtual void write(const char* data, size_t len) = 0;
+    virtual std::string read_line(int timeout_ms = 10000) = 0;
+    virtual void flush() {}          // push out queued writes without waiting for a reply
+    virtual void discard_input() {}  // forget buffered input, e.g. after tcflush()
+    void write(const std::string& s) { write(s.c_str(), s.size()); }
+};
+
+struct PlainIo : SerialIo {
+    std::string partial;
+    explicit PlainIo(int f) { fd = f; }
+    void write(const char* data, size_t len) override { io_syscalls++; ::write(fd, data, len); }
+    void discard_input() override { partial.clear(); }
+    std::string read_line(int timeout_ms = 10000) override {
+        if (!::read_line(fd, partial, timeout_ms)) return "";
+        return std::exchange(partial, {});
+    }
+};
 
-std::string modify_line(const std::string& orig, const Overrides& ov) {
-    std::string line = orig;
-    trim(line);
-    if (line.empty() || line[0] == ';') return orig;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if HAVE_IO_URING
+// One ring serves any number of ttys. Input lands in a provided-buffer ring and
+// is split into lines per fd; writes are only queued as SQEs until someone
+// waits, then go out with the same io_uring_enter() that collects completions.
+class UringLoop {
+public:
+    static constexpr unsigned ENTRIES = 256;
+    static constexpr unsigned NUM_BUFS = 256;
+    static constexpr unsigned BUF_SIZE = 256;
+    static constexpr __u8 OP_READ_MULTISHOT = 49;   // Linux 6.7, newer than some distro headers
+    static constexpr __u16 BGID = 1;
 
-    std::istringstream iss(line);
-    std::string token, result;
-    bool has_F = false;
-    double old_F = 0;
+    bool init() {
+        struct io_uring_params p{};
+        ring_fd = (int)syscall(__NR_io_uring_setup, ENTRIES, &p);
+        if (ring_fd < 0) return false;
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) { close(ring_fd); ring_fd = -1; return false; }
 
-    while (iss >> token) {
-        if (token.size() < 2) { result += " " + token; continue; }
-        char code = std::toupper(token[0]);
-        std::string val = token.substr(1);
+        ring_sz = std::max(p.sq_off.array + p.sq_entries * sizeof(__u32), p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+        ring = (char*)mmap(nullptr, ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*)mmap(nullptr, sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (ring == MAP_FAILED || sqes == MAP_FAILED) return false;
 
-        if (code == 'F') {
-            has_F = true;
-            old_F = std::stod(val);
-            if (ov.feedrate_percent > 0) {
-                int new_F = int(old_F * ov.feedrate_percent / 100.0 + 0.5);
-                result += " F" + std::to_string(new_F);
-                continue;
-            }
+        sq_head = (unsigned*)(ring + p.sq_off.head);  sq_tail = (unsigned*)(ring + p.sq_off.tail);
+        sq_mask = *(unsigned*)(ring + p.sq_off.ring_mask);  sq_array = (unsigned*)(ring + p.sq_off.array);
+        cq_head = (unsigned*)(ring + p.cq_off.head);  cq_tail = (unsigned*)(ring + p.cq_off.tail);
+        cq_mask = *(unsigned*)(ring + p.cq_off.ring_mask);  cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+
+        // Provided buffers for multishot reads; without them (pre-5.19) fall back to one read per fd at a time
+        bufring_sz = NUM_BUFS * sizeof(struct io_uring_buf);
+        bufring = (struct io_uring_buf*)mmap(nullptr, bufring_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        bufs.resize(NUM_BUFS * BUF_SIZE);
+        struct io_uring_buf_reg reg{};
+        reg.ring_addr = (__u64)(uintptr_t)bufring;
+        reg.ring_entries = NUM_BUFS;
+        reg.bgid = BGID;
+        multishot = bufring != MAP_FAILED && syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+        if (multishot) for (unsigned i = 0; i < NUM_BUFS; ++i) recycle(i);
+        return true;
+    }
+
+    ~UringLoop() {
+        if (ring && ring != MAP_FAILED) munmap(ring, ring_sz);
+        if (sqes && sqes != MAP_FAILED) munmap(sqes, sqes_sz);
+        if (bufring && bufring != MAP_FAILED) munmap(bufring, bufring_sz);
+        if (ring_fd >= 0) close(ring_fd);
+    }
+
+    int add(int fd) {
+        int slot = (int)fds.size();
+        fds.push_back({ fd, "", std::vector<char>(BUF_SIZE) });
+        arm_read(slot);
+        return slot;
+    }
+
+    void queue_write(int slot, const char* data, size_t len) {
+        unsigned id = next_write++;
+        const std::string& w = writes.emplace(id, std::string(data, len)).first->second;
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fds[slot].fd;
+        sqe->addr = (__u64)(uintptr_t)w.data();
+        sqe->len = (unsigned)len;
+        sqe->off = (__u64)-1;
+        sqe->user_data = tag(slot, KIND_WRITE, id);
+    }
+
+    // Submit whatever is queued and collect completions; wait up to timeout_ms
+    // for at least one when none are ready yet. False on timeout.
+    bool wait(int timeout_ms) {
+        if (*cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) && !pending) { reap(); return true; }
+
+        struct __kernel_timespec ts{ timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000 };
+        struct io_uring_getevents_arg arg{};
+        arg.ts = (__u64)(uintptr_t)&ts;
+        io_syscalls++;
+        int r = (int)syscall(__NR_io_uring_enter, ring_fd, pending, timeout_ms ? 1 : 0,
+                             IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+        if (r >= 0) pending -= std::min<unsigned>(pending, r);
+        return reap() > 0;
+    }
+
+    void flush() { if (pending) wait(0); }
+
+    std::string& input(int slot) { return fds[slot].in; }
+    int error(int slot) const { return fds[slot].error; }   // reads stopped: EOF or an error
+
+private:
+    // user_data: write id << 32 | fd slot << 8 | kind
+    enum Kind : __u64 { KIND_READ = 1, KIND_WRITE = 2 };
+    static __u64 tag(int slot, Kind k, unsigned id = 0) { return (__u64)id << 32 | (__u64)slot << 8 | k; }
+
+    struct Fd { int fd; std::string in; std::vector<char> buf; int error = 0; };
+
+    int ring_fd = -1;
+    char* ring = nullptr;
+    size_t ring_sz = 0, sqes_sz = 0, bufring_sz = 0;
+    struct io_uring_sqe* sqes = nullptr;
+    unsigned *sq_head, *sq_tail, *sq_array, *cq_head, *cq_tail;
+    unsigned sq_mask = 0, cq_mask = 0, pending = 0;
+    struct io_uring_cqe* cqes = nullptr;
+    struct io_uring_buf* bufring = nullptr;
+    std::vector<char> bufs;
+    bool multishot = false;
+    std::vector<Fd> fds;
+    std::unordered_map<unsigned, std::string> writes;   // kept alive until their completion arrives
+    unsigned next_write = 0;
+
+    struct io_uring_sqe* get_sqe() {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_mask) wait(0);   // full: submit first
+        struct io_uring_sqe* sqe = &sqes[tail & sq_mask];
+        std::memset(sqe, 0, sizeof *sqe);
+        sq_array[tail & sq_mask] = tail & sq_mask;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        pending++;
+        return sqe;
+    }
+
+    void arm_read(int slot) {
+        struct io_uring_sqe* sqe = get_sqe();
+        sqe->fd = fds[slot].fd;
+        sqe->off = (__u64)-1;
+        sqe->user_data = tag(slot, KIND_READ);
+        if (multishot) {
+            sqe->opcode = OP_READ_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = BGID;
+        } else {
+            sqe->opcode = IORING_OP_READ;
+            sqe->addr = (__u64)(uintptr_t)fds[slot].buf.data();
+            sqe->len = BUF_SIZE;
         }
-        if (code == 'S') {
-            if (ov.bed_temp >= 0 && (line.find("M140") == 0 || line.find("M190") == 0)) {
-                result += " S" + std::to_string(ov.bed_temp);
+    }
+
+    // The ring tail lives in bufring[0].resv. (io_uring_buf_ring's flexible
+    // array is laid out differently in C++, so don't go through it.)
+    void recycle(unsigned bid) {
+        __u16* tail = &bufring[0].resv;
+        struct io_uring_buf* b = &bufring[*tail & (NUM_BUFS - 1)];
+        b->addr = (__u64)(uintptr_t)&bufs[bid * BUF_SIZE];
+        b->len = BUF_SIZE;
+        b->bid = (__u16)bid;
+        __atomic_store_n(tail, (__u16)(*tail + 1), __ATOMIC_RELEASE);
+    }
+
+    int reap() {
+        int n = 0;
+        unsigned head = *cq_head;
+        for (; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); ++head, ++n) {
+            struct io_uring_cqe* cqe = &cqes[head & cq_mask];
+            int slot = int((cqe->user_data >> 8) & 0xffffff);
+            if ((cqe->user_data & 0xff) == KIND_WRITE) {
+                writes.erase(unsigned(cqe->user_data >> 32));
                 continue;
             }
-            if (ov.hotend_temp >= 0 && (line.find("M104") == 0 || line.find("M109") == 0)) {
-                result += " S" + std::to_string(ov.hotend_temp);
+            if (cqe->res > 0) {
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    fds[slot].in.append(&bufs[bid * BUF_SIZE], cqe->res);
+                    recycle(bid);
+                } else {
+                    fds[slot].in.append(fds[slot].buf.data(), cqe->res);
+                }
+            } else if (cqe->res == -EINVAL && multishot) {
+                multishot = false;   // kernel older than 6.7: no multishot read
+            } else if (cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -EAGAIN) {
+                // EOF or an error such as EIO: re-arming would complete at once, forever
+                fds[slot].error = cqe->res ? -cqe->res : EIO;
                 continue;
             }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) arm_read(slot);
         }
-        result += " " + token;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return n;
     }
+};
+
+struct UringIo : SerialIo {
+    UringLoop& loop;
+    int slot;
+    bool reported = false;
+    UringIo(UringLoop& l, int f) : loop(l), slot(l.add(f)) { fd = f; }
 
-    if (has_F && ov.feedrate_percent > 0 && ov.debug)
-        std::cout << "   Feedrate " << int(old_F) << " → " << int(old_F * ov.feedrate_percent / 100.0 + 0.5) << "\n";
+    void write(const char* data, size_t len) override { loop.queue_write(slot, data, len); }
+    void flush() override { loop.flush(); }
+    void discard_input() override { loop.input(slot).clear(); }
 
-    if (result != (" " + line)) {
-        trim(result);
-        return result;
+    std::string read_line(int timeout_ms = 10000) override {
+        auto start = SessionClock::now();
+        while (true) {
+            std::string& in = loop.input(slot);
+            size_t nl = in.find('\n');
+            if (nl != std::string::npos) {
+                std::string s = in.substr(0, nl);
+                in.erase(0, nl + 1);
+                s.erase(std::remove(s.begin(), s.end(), '\r'), s.end());
+                return s;
+            }
+            int left = timeout_ms - int(std::chrono::duration_cast<std::chrono::milliseconds>(SessionClock::now() - start).count());
+            if (left <= 0) return "";
+            if (int err = loop.error(slot)) {
+                // Nothing more will come: time out as a dead printer would, and the engine calls the link lost
+                if (!reported) std::cerr << "\nSerial port read failed: " << strerror(err) << "\n";
+                reported = true;
+                host_clock->sleep_for(std::chrono::milliseconds(left));
+                return "";
+            }
+            loop.wait(left);
+        }
     }
-    return orig;
+};
+#endif
+
+// ---- Transports ----------------------------------------------------------------
+// What the device argument names. A path is a serial port — termios raw at
+// the baud rate, and opening it resets the printer through DTR — or a pty
+// (socat, "sim"), where the rate means nothing and nothing resets.
+// tcp://host:port is a ser2net-style bridge: TCP_NODELAY so a line never sits
+// in Nagle's buffer, TcpIo holding writes back until the next read or flush so
+// a window of lines goes out as one segment, and keepalive so a dead bridge
+// shows up as a lost link. "null" is no device at all: NullIo acks each line
+// as it is written, for timing the host side alone. Baud changes (--auto-baud,
+// --selftest's ladder) need a serial port or a pty.
+
+enum class Transport { Serial, Pty, Tcp, Null };
+const char* TRANSPORT_NAMES[] = { "serial", "pty", "tcp", "null" };
+
+// From the name; a path is Serial until open_transport() finds a pty behind it
+Transport transport_of(const std::string& dev) {
+    if (dev == "null") return Transport::Null;
+    if (dev.rfind("tcp://", 0) == 0) return Transport::Tcp;
+    return dev == "sim" ? Transport::Pty : Transport::Serial;
 }
 
-int main(int argc, char** argv) {
-    if (argc < 4) { print_help(argv[0]); return 1; }
+bool has_baud(Transport t) { return t == Transport::Serial || t == Transport::Pty; }
 
-    std::string dev = argv[1];
-    int baud = std::stoi(argv[2]);
-    std::string file = argv[3];
-    Overrides ov;
+// "host:port" or "[v6addr]:port" → a connected, non-blocking socket; -1 on failure
+int connect_tcp(const std::string& addr) {
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos) { std::cerr << "Expected tcp://host:port, got tcp://" << addr << "\n"; return -1; }
+    std::string host = addr.substr(0, colon), port = addr.substr(colon + 1);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
 
-    for (int i = 4; i < argc; ++i) {
-        std::string a = argv[i];
-        if (a == "--debug") ov.debug = true;
-        else if (a.find("--feedrate=") == 0) ov.feedrate_percent = std::stoi(a.substr(11));
-        else if (a.find("--bed=") == 0) ov.bed_temp = std::stoi(a.substr(6));
-        else if (a.find("--hotend=") == 0) ov.hotend_temp = std::stoi(a.substr(9));
-        else if (a == "--help") { print_help(argv[0]); return 0; }
+    struct addrinfo hints{}, *res;
+    hints.ai_socktype = SOCK_STREAM;
+    if (int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res); rc != 0) {
+        std::cerr << "Cannot resolve " << host << ": " << gai_strerror(rc) << "\n";
+        return -1;
     }
+    int fd = -1, err = 0;
+    for (struct addrinfo* a = res; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) { err = errno; close(fd); fd = -1; }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) { std::cerr << "Cannot connect to " << addr << ": " << strerror(err) << "\n"; return -1; }
+
+    int one = 1, idle = 10, interval = 5, probes = 3;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof one);
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof idle);
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof interval);
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof probes);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);   // reads poll, as on a VMIN=0 tty
+    return fd;
+}
 
+// Opens dev as t says and sets it up; a path turns out to be Serial or Pty. -1 on failure.
+int open_transport(const std::string& dev, int baud, Transport& t) {
+    if (t == Transport::Null) return -1;
+    if (t == Transport::Tcp) return connect_tcp(dev.substr(6));
     int fd = open(dev.c_str(), O_RDWR | O_NOCTTY | O_SYNC);
-    if (fd < 0) { std::cerr << "Cannot open " << dev << ": " << strerror(errno) << "\n"; return 1; }
+    if (fd < 0) { std::cerr << "Cannot open " << dev << ": " << strerror(errno) << "\n"; return -1; }
+    if (set_serial(fd, baud) != 0) { std::cerr << "Failed to set serial parameters\n"; close(fd); return -1; }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode) && major(st.st_rdev) >= 136 && major(st.st_rdev) <= 143)
+        t = Transport::Pty;   // UNIX98_PTY_SLAVE_MAJOR
+    return fd;
+}
 
-    if (set_serial(fd, baud) != 0) {
-        std::cerr << "Failed to set serial parameters\n"; close(fd); return 1;
+struct TcpIo : SerialIo {
+    std::string in, out;
+    bool closed = false;
+    explicit TcpIo(int f) { fd = f; }
+
+    void write(const char* data, size_t len) override { out.append(data, len); }
+
+    void flush() override {
+        for (size_t done = 0; done < out.size() && !closed; ) {
+            io_syscalls++;
+            ssize_t n = ::send(fd, out.data() + done, out.size() - done, MSG_NOSIGNAL);
+            if (n > 0) { done += n; continue; }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) { struct pollfd p{ fd, POLLOUT, 0 }; io_syscalls++; poll(&p, 1, 1000); continue; }
+            closed = true;   // reset or closed by the bridge: reads time out from here on
+        }
+        out.clear();
     }
-    usleep(2000000);
 
-    std::cout << "Connected to " << dev << " @ " << baud << " baud\n";
-    if (ov.feedrate_percent > 0) std::cout << "  Feedrate × " << ov.feedrate_percent << "%\n";
-    if (ov.bed_temp >= 0)        std::cout << "  Bed forced → " << ov.bed_temp << "°C\n";
-    if (ov.hotend_temp >= 0)     std::cout << "  Hotend forced → " << ov.hotend_temp << "°C\n\n";
+    void discard_input() override { in.clear(); }
+
+    std::string read_line(int timeout_ms = 10000) override {
+        flush();
+        auto deadline = SessionClock::now() + std::chrono::milliseconds(timeout_ms);
+        char buf[4096];
+        while (true) {
+            size_t nl = in.find('\n');
+            if (nl != std::string::npos) {
+                std::string s = in.substr(0, nl);
+                in.erase(0, nl + 1);
+                s.erase(std::remove(s.begin(), s.end(), '\r'), s.end());
+                return s;
+            }
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - SessionClock::now());
+            if (left.count() <= 0) return "";
+            if (closed) { host_clock->sleep_for(left); return ""; }
+            struct pollfd p{ fd, POLLIN, 0 };
+            io_syscalls++;
+            if (poll(&p, 1, int(left.count())) <= 0) continue;
+            io_syscalls++;
+            ssize_t n = ::recv(fd, buf, sizeof buf, 0);
+            if (n > 0) in.append(buf, n);
+            else if (n == 0 || (errno != EAGAIN && errno != EINTR)) closed = true;
+        }
+    }
+};
+
+struct NullIo : SerialIo {
+    long oks = 0;
+    void write(const char* data, size_t len) override { oks += std::count(data, data + len, '\n'); }
+    void discard_input() override { oks = 0; }
+    std::string read_line(int timeout_ms = 10000) override {
+        if (oks > 0) { oks--; return "ok"; }
+        host_clock->sleep_for(std::chrono::milliseconds(timeout_ms));
+        return "";
+    }
+};
+
+void emergency_reset(SerialIo& io, bool debug) {
+    std::cout << "\nFORCING HARD RESET (M112 + M999)\n";
+    io.write("M112\nM999\n", 10);
+    io.flush();
+    if (debug) std::cout << ">> M112\n>> M999\n";
+    host_clock->sleep_for(std::chrono::seconds(4));
+    tcflush(io.fd, TCIOFLUSH);
+    io.discard_input();
+    std::cout << "Printer rebooted — fresh start\n\n";
+}
+
+// "N<n> <gcode>*<checksum>\n" — what Marlin expects for a numbered line
+std::string frame_line(int n, const std::string& gcode) {
+    std::string payload = "N" + std::to_string(n) + " " + gcode;
+    unsigned char cs = 0;
+    for (char c : payload) cs ^= (unsigned char)c;
+    return payload + "*" + std::to_string((int)cs) + "\n";
+}
 
-    std::ifstream f(file);
-    if (!f.is_open()) { std::cerr << "Cannot open " << file << "\n"; close(fd); return 1; }
+// Sliding-window error counter for the serial link. Resends, checksum and
+// line-number errors and timeouts all count; too many inside the window means
+// the cable can't hold the current rate, a long clean stretch means we can
+// try the next one up again.
+enum class LinkEvent { Resend, Checksum, LineNumber, Timeout };
 
-    int total = 0, sent = 0;
-    { std::string tmp; while (std::getline(f, tmp)) { trim(tmp); if (!tmp.empty() && tmp[0] != ';') total++; } }
-    f.clear(); f.seekg(0);
+struct LinkMonitor {
+    bool auto_baud = false;
+    int window_s = 60;
+    int max_errors = 5;
+    int clean_s = 300;
+    int max_baud = 0;            // the rate asked for on the command line — never go above it
 
-    std::cout << "Streaming " << file << " (" << total << " commands)\n\n";
+    std::deque<SessionClock::time_point> errors;
+    SessionClock::time_point last_event = SessionClock::now();
+    std::atomic<int> resends{0}, checksum{0}, line_number{0}, timeouts{0}, step_downs{0}, step_ups{0};   // read by the metrics thread
+    bool error_pending = false;  // Marlin follows each Error: with a Resend: — count the pair once
 
-    int line_num = 1, resend_streak = 0;
-    std::string line;
+    void record(LinkEvent e) {
+        switch (e) {
+            case LinkEvent::Resend:     resends++;     break;
+            case LinkEvent::Checksum:   checksum++;    break;
+            case LinkEvent::LineNumber: line_number++; break;
+            case LinkEvent::Timeout:    timeouts++;    break;
+        }
+        bool follows_error = e == LinkEvent::Resend && error_pending;
+        error_pending = e == LinkEvent::Checksum || e == LinkEvent::LineNumber;
+        last_event = SessionClock::now();
+        if (!follows_error) errors.push_back(last_event);
+    }
 
-    while (std::getline(f, line)) {
-        std::string modified = modify_line(line, ov);
-        trim(modified);
-        if (modified.empty() || modified[0] == ';') continue;
+    // Rate we should be running at, or 0 to stay put. Call between commands only.
+    int wanted_baud(int baud) {
+        if (!auto_baud) return 0;
+        auto now = SessionClock::now();
+        while (!errors.empty() && now - errors.front() > std::chrono::seconds(window_s)) errors.pop_front();
 
-        std::string payload = "N" + std::to_string(line_num) + " " + modified;
-        unsigned char cs = 0;
-        for (char c : payload) cs ^= (unsigned char)c;
-        std::string cmd = payload + "*" + std::to_string((int)cs) + "\n";
+        int i = 0;
+        while (i < NUM_BAUD_RATES && BAUD_RATES[i] != baud) i++;
+        if (i == NUM_BAUD_RATES) return 0;
+
+        if ((int)errors.size() >= max_errors && i > 0) return BAUD_RATES[i - 1];
+        if (errors.empty() && i + 1 < NUM_BAUD_RATES && BAUD_RATES[i + 1] <= max_baud &&
+            now - last_event > std::chrono::seconds(clean_s)) return BAUD_RATES[i + 1];
+        return 0;
+    }
+
+    // Start a fresh window at the new rate
+    void changed(int from, int to) {
+        (to < from ? step_downs : step_ups)++;
+        errors.clear();
+        last_event = SessionClock::now();
+    }
+
+    // The printer stayed at its rate: asking again after every command won't help
+    void refused() {
+        auto_baud = false;
+        errors.clear();
+    }
+};
+
+// "Resend: 42" / "rs 42" → 42, anything else → -1
+long parse_resend(const std::string& resp) {
+    size_t p;
+    if (resp.rfind("Resend:", 0) == 0) p = 7;
+    else if (resp.rfind("rs ", 0) == 0) p = 3;
+    else return -1;
+    while (p < resp.size() && (resp[p] == ' ' || resp[p] == 'N')) p++;
+    return p < resp.size() && std::isdigit((unsigned char)resp[p]) ? std::atol(resp.c_str() + p) : -1;
+}
 
-        write(fd, cmd.c_str(), cmd.size());
-        if (ov.debug) std::cout << ">> " << cmd.substr(0, cmd.size()-1);
-        sent++;
+void classify_response(const std::string& resp, LinkMonitor& link) {
+    if (resp.find("checksum mismatch") != std::string::npos || resp.find("No Checksum") != std::string::npos)
+        link.record(LinkEvent::Checksum);
+    else if (resp.find("Line Number is not Last Line Number+1") != std::string::npos)
+        link.record(LinkEvent::LineNumber);
+    else if (parse_resend(resp) >= 0)
+        link.record(LinkEvent::Resend);
+}
+
+// Unnumbered M105 answered with an ok within a second
+bool ping_printer(SerialIo& io) {
+    io.write("M105\n", 5);
+    io.flush();
+    for (std::string resp; !(resp = io.read_line(1000)).empty(); )
+        if (resp.find("ok") != std::string::npos) return true;
+    return false;
+}
+
+// Refused: the printer answered at the old rate. Reverted: nothing at the new
+// rate, but the printer is back on the old one — whether it ever got the M575
+// is unknown, so resync line numbers. Lost: it answers at neither.
+enum class BaudChange { Switched, Refused, Reverted, Lost };
+
+// Ask Marlin to switch with M575 (sent as the next numbered line) and follow it
+// on our side. Marlin changes rate before it acks, so the ok arrives at the new
+// rate; firmware without M575 or without this rate answers at the old one.
+BaudChange renegotiate_baud(SerialIo& io, int& baud, int new_baud, int& line_num, bool debug) {
+    std::string cmd = frame_line(line_num, "M575 P0 B" + std::to_string(new_baud));
+
+    io.write(cmd);
+    io.flush();
+    tcdrain(io.fd);
+    if (debug) std::cout << ">> " << cmd.substr(0, cmd.size()-1) << "\n";
+
+    for (std::string resp; !(resp = io.read_line(200)).empty(); ) {
+        if (debug) std::cout << "<< " << resp << "\n";
+        if (resp.find("Unknown command") != std::string::npos || resp.find("implausible") != std::string::npos) {
+            io.read_line(500);   // its ok
+            line_num++;
+            std::cout << "\nPrinter can't change to " << new_baud << " baud — staying at " << baud << "\n";
+            return BaudChange::Refused;
+        }
+        if (resp.find("ok") != std::string::npos) { line_num++; return BaudChange::Refused; }   // acked at the old rate: no M575
+    }
 
-        bool got_ok = false;
-        while (!got_ok) {
-            std::string resp = read_line(fd);
-            if (resp.empty()) { std::cerr << "\nTimeout!\n"; close(fd); return 1; }
-            if (ov.debug) std::cout << "<< " << resp << "\n";
+    struct termios tty{};
+    tcgetattr(io.fd, &tty);
+    speed_t speed = get_baud_constant(new_baud);
+    cfsetospeed(&tty, speed);
+    cfsetispeed(&tty, speed);
+    tcsetattr(io.fd, TCSANOW, &tty);
+    tcflush(io.fd, TCIOFLUSH);
+    io.discard_input();
+    line_num++;
 
+    // The M575 ok may have been lost mid-switch — make sure we really hear each other
+    for (int tries = 0; tries < 3; ++tries) {
+        io.write("M105\n", 5);
+        for (std::string resp; !(resp = io.read_line(1000)).empty(); )
             if (resp.find("ok") != std::string::npos) {
-                got_ok = true; line_num++; resend_streak = 0;
-                if (sent % 25 == 0 || ov.debug)
-                    std::cout << "\rProgress: " << (sent*100/total) << "% (" << sent << "/" << total << ")    " << std::flush;
-            }
-            else if (resp.find("Resend") != std::string::npos || resp.find("rs") != std::string::npos) {
-                if (++resend_streak >= 3) {
-                    emergency_reset(fd, ov.debug);
-                    line_num = 1; resend_streak = 0;
-                }
-                write(fd, cmd.c_str(), cmd.size());
+                std::cout << "\nLink " << baud << " → " << new_baud << " baud\n";
+                baud = new_baud;
+                return BaudChange::Switched;
             }
+    }
+    std::cerr << "\nNo answer at " << new_baud << " baud after M575\n";
+
+    // The printer either never switched or is on a rate the link can't hold.
+    // Try both, asking it back to the old rate on the latter.
+    for (int tries = 0; tries < 3; ++tries) {
+        set_serial(io.fd, baud);
+        io.discard_input();
+        if (ping_printer(io)) { std::cerr << "Back at " << baud << " baud\n"; return BaudChange::Reverted; }
+        set_serial(io.fd, new_baud);
+        io.discard_input();
+        std::string back = "M575 P0 B" + std::to_string(baud) + "\n";
+        io.write(back);
+        io.flush();
+        tcdrain(io.fd);
+        host_clock->sleep_for(std::chrono::milliseconds(200));
+    }
+    std::cerr << "No answer at " << baud << " baud either\n";
+    return BaudChange::Lost;
+}
+
+void trim(std::string& s) {
+    s.erase(0, s.find_first_not_of(" \t\r\n"));
+    s.erase(s.find_last_not_of(" \t\r\n") + 1);
+}
+
+// Puts std::cout's float format and precision back when it goes out of scope;
+// std::defaultfloat alone leaves the precision a report set behind
+struct CoutFormat {
+    std::ios_base::fmtflags flags = std::cout.flags();
+    std::streamsize precision = std::cout.precision();
+    ~CoutFormat() { std::cout.flags(flags); std::cout.precision(precision); }
+};
+
+// d × num / den, rounded half away from zero, same number of decimals
+Decimal scale_decimal(Decimal d, long long num, long long den) {
+    long long x = d.mant * num;
+    d.mant = (x + (x < 0 ? -den / 2 : den / 2)) / den;
+    return d;
+}
+
+long long pow10(int n) { long long p = 1; while (n-- > 0) p *= 10; return p; }
+
+Decimal add_decimal(Decimal a, Decimal b) {
+    int d = std::max(a.decimals, b.decimals);
+    return { a.mant * pow10(d - a.decimals) + b.mant * pow10(d - b.decimals), d };
+}
+
+void append_decimal(std::string& out, Decimal d) {
+    char buf[24];
+    auto r = std::to_chars(buf, buf + sizeof buf, d.mant < 0 ? -d.mant : d.mant);
+    std::string_view digits(buf, r.ptr - buf);
+    if (d.mant < 0) out += '-';
+    if ((int)digits.size() <= d.decimals) {
+        out += "0.";
+        out.append(d.decimals - digits.size(), '0');
+        out += digits;
+        return;
+    }
+    out += digits.substr(0, digits.size() - d.decimals);
+    if (d.decimals) { out += '.'; out += digits.substr(digits.size() - d.decimals); }
+}
+
+// d × pct / 100 without rounding, then cut to at most max(d's decimals, 5)
+// places — E2 at 95% is E1.9, not E2 — and trailing zeros past d's precision dropped
+Decimal scale_percent(Decimal d, Decimal pct) {
+    Decimal r{ d.mant * pct.mant, d.decimals + pct.decimals + 2 };
+    int keep = std::max(d.decimals, 5);
+    if (r.decimals > keep) { r = scale_decimal(r, 1, pow10(r.decimals - keep)); r.decimals = keep; }
+    while (r.decimals > d.decimals && r.mant % 10 == 0) { r.mant /= 10; r.decimals--; }
+    return r;
+}
+
+// Commands whose argument is free text, not parameters
+bool takes_text(char letter, int num) {
+    return letter == 'M' && (num == 0 || num == 1 || num == 23 || num == 28 || num == 30 || num == 32 ||
+                             num == 33 || num == 117 || num == 118 || num == 928);
+}
+
+// ---- Line scanner ------------------------------------------------------------
+// Files are mapped and cut into lines here, 16 or 32 bytes at a time: where the
+// line ends, where a ';' comment starts and the first and last non-blank byte
+// before it. Comment headers are thousands of long comment lines, and after a
+// ';' only the newline is looked for. Blocks with begin/end markers —
+// thumbnails, config dumps — are not cut into lines at all: one search for
+// the end marker, one pass that counts the newlines in between and checks
+// every line is a comment. The best ISA is picked at startup; --bench-scan
+// times each one.
+
+// A whole file mapped read-only
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { if (size) munmap((void*)data, size); }
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st{};
+        if (fd < 0 || fstat(fd, &st) != 0) { if (fd >= 0) close(fd); return false; }
+        if (st.st_size > 0) {
+            void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m == MAP_FAILED) { close(fd); return false; }
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            data = (const char*)m;
+            size = st.st_size;
         }
+        close(fd);
+        return true;
     }
 
-    std::cout << "\n\nFinishing... ";
-    write(fd, "M400\n", 5);
-    while (read_line(fd).find("ok") == std::string::npos);
-    std::cout << "done!\n\nPRINT COMPLETED SUCCESSFULLY!\n";
-    close(fd);
-    return 0;
+    const char* data = "";
+    size_t size = 0;
+};
+
+enum class ScanIsa { Scalar, Sse2, Avx2, Neon, Count };
+const char* const SCAN_ISA_NAMES[] = { "scalar", "sse2", "avx2", "neon" };
+
+struct LineInfo {
+    const char* eol;                 // the '\n', or the end of the buffer
+    const char* first = nullptr;     // content, comment and blanks excluded: [first, last)
+    const char* last = nullptr;
+};
+
+inline bool scan_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Byte at a time from q to the newline — the scalar scanner, and every vector scanner's tail
+inline LineInfo scan_tail(const char* q, const char* end, LineInfo r, bool comment) {
+    for (; q < end && *q != '\n'; ++q) {
+        if (comment) continue;
+        if (*q == ';') comment = true;
+        else if (!scan_blank(*q)) { if (!r.first) r.first = q; r.last = q + 1; }
+    }
+    r.eol = q;
+    return r;
+}
+
+LineInfo scan_line_scalar(const char* p, const char* end) { return scan_tail(p, end, LineInfo{ end }, false); }
+
+// One block's compare masks, `bits` per byte (1 from movemask, 4 from NEON's
+// narrowing shift). True once the newline has been found.
+[[gnu::always_inline]] inline bool scan_block(LineInfo& r, bool& comment, const char* q, int bits,
+                                              uint64_t nl, uint64_t semi, uint64_t solid) {
+    if (!comment) {
+        uint64_t stop = nl | semi;
+        if (stop) solid &= (stop & -stop) - 1;
+        if (solid) {
+            if (!r.first) r.first = q + __builtin_ctzll(solid) / bits;
+            r.last = q + (63 - __builtin_clzll(solid)) / bits + 1;
+        }
+        comment = semi != 0;
+    }
+    if (!nl) return false;
+    r.eol = q + __builtin_ctzll(nl) / bits;
+    return true;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+LineInfo scan_line_sse2(const char* p, const char* end) {
+    LineInfo r{ end };
+    bool comment = false;
+    const __m128i n = _mm_set1_epi8('\n'), sc = _mm_set1_epi8(';');
+    const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), cr = _mm_set1_epi8('\r');
+    const char* q = p;
+    for (; q + 16 <= end; q += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)q);
+        uint64_t nl = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, n));
+        if (comment) {
+            if (nl) { r.eol = q + __builtin_ctzll(nl); return r; }
+            continue;
+        }
+        uint64_t semi = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, sc));
+        __m128i blank = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)), _mm_cmpeq_epi8(v, cr));
+        uint64_t solid = ~(unsigned)_mm_movemask_epi8(blank) & 0xFFFF;
+        if (scan_block(r, comment, q, 1, nl, semi, solid)) return r;
+    }
+    return scan_tail(q, end, r, comment);
+}
+
+__attribute__((target("avx2")))
+LineInfo scan_line_avx2(const char* p, const char* end) {
+    LineInfo r{ end };
+    bool comment = false;
+    const __m256i n = _mm256_set1_epi8('\n'), sc = _mm256_set1_epi8(';');
+    const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), cr = _mm256_set1_epi8('\r');
+    const char* q = p;
+    for (; q + 32 <= end; q += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)q);
+        uint64_t nl = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, n));
+        if (comment) {
+            if (nl) { r.eol = q + __builtin_ctzll(nl); return r; }
+            continue;
+        }
+        uint64_t semi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, sc));
+        __m256i blank = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab)), _mm256_cmpeq_epi8(v, cr));
+        uint64_t solid = ~(uint64_t)(uint32_t)_mm256_movemask_epi8(blank) & 0xFFFFFFFF;
+        if (scan_block(r, comment, q, 1, nl, semi, solid)) return r;
+    }
+    return scan_tail(q, end, r, comment);
+}
+#endif
+
+#if defined(__ARM_NEON)
+// No movemask on NEON: narrow each 0x00/0xFF byte to a nibble of a 64-bit word
+inline uint64_t neon_mask(uint8x16_t eq) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+LineInfo scan_line_neon(const char* p, const char* end) {
+    LineInfo r{ end };
+    bool comment = false;
+    const uint8x16_t n = vdupq_n_u8('\n'), sc = vdupq_n_u8(';');
+    const uint8x16_t sp = vdupq_n_u8(' '), tab = vdupq_n_u8('\t'), cr = vdupq_n_u8('\r');
+    const char* q = p;
+    for (; q + 16 <= end; q += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t*)q);
+        uint64_t nl = neon_mask(vceqq_u8(v, n));
+        if (comment) {
+            if (nl) { r.eol = q + __builtin_ctzll(nl) / 4; return r; }
+            continue;
+        }
+        uint64_t semi = neon_mask(vceqq_u8(v, sc));
+        uint64_t solid = ~neon_mask(vorrq_u8(vorrq_u8(vceqq_u8(v, sp), vceqq_u8(v, tab)), vceqq_u8(v, cr)));
+        if (scan_block(r, comment, q, 4, nl, semi, solid)) return r;
+    }
+    return scan_tail(q, end, r, comment);
+}
+#endif
+
+// Comment blocks slicers embed: base64 thumbnails, configuration dumps. The
+// third byte of each end marker is what the skippers compare first.
+const std::pair<std::string_view, std::string_view> COMMENT_BLOCKS[] = {
+    { "; thumbnail begin", "; thumbnail end" },
+    { "; thumbnail_JPG begin", "; thumbnail_JPG end" },
+    { "; thumbnail_QOI begin", "; thumbnail_QOI end" },
+    { "; THUMBNAIL_BLOCK_START", "; THUMBNAIL_BLOCK_END" },
+    { "; CONFIG_BLOCK_START", "; CONFIG_BLOCK_END" },
+    { "; prusaslicer_config = begin", "; prusaslicer_config = end" },
+};
+
+// From the newline at p: the start of the line that begins with marker, and
+// how many lines come before it. nullptr if a line on the way isn't a comment
+// or there is no such line. Only the newlines are looked at, and the marker is
+// compared where the byte after "; " matches.
+inline bool block_newline(const char* q, std::string_view marker, long& lines, const char*& found) {
+    if (q[1] != ';') { found = nullptr; return true; }
+    if (std::string_view(q + 1, marker.size()) == marker) { found = q + 1; return true; }
+    lines++;
+    return false;
+}
+
+const char* skip_block_scalar(const char* p, const char* end, std::string_view marker, long& lines) {
+    const char* found = nullptr;
+    for (; p + marker.size() < end; ++p)
+        if (*p == '\n' && block_newline(p, marker, lines, found)) return found;
+    return nullptr;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+const char* skip_block_sse2(const char* p, const char* end, std::string_view marker, long& lines) {
+    const __m128i n = _mm_set1_epi8('\n'), sc = _mm_set1_epi8(';'), key = _mm_set1_epi8(marker[2]);
+    const char* found = nullptr;
+    for (; p + 16 + marker.size() < end; p += 16) {
+        unsigned nl = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), n));
+        if (!nl) continue;
+        unsigned semi = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 1)), sc));
+        unsigned cand = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 3)), key));
+        if ((nl & ~semi) || (nl & cand)) {
+            for (; nl; nl &= nl - 1)
+                if (block_newline(p + __builtin_ctz(nl), marker, lines, found)) return found;
+            continue;
+        }
+        lines += __builtin_popcount(nl);
+    }
+    return skip_block_scalar(p, end, marker, lines);
+}
+
+__attribute__((target("avx2")))
+const char* skip_block_avx2(const char* p, const char* end, std::string_view marker, long& lines) {
+    const __m256i n = _mm256_set1_epi8('\n'), sc = _mm256_set1_epi8(';'), key = _mm256_set1_epi8(marker[2]);
+    const char* found = nullptr;
+    for (; p + 32 + marker.size() < end; p += 32) {
+        uint32_t nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), n));
+        if (!nl) continue;
+        uint32_t semi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 1)), sc));
+        uint32_t cand = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 3)), key));
+        if ((nl & ~semi) || (nl & cand)) {
+            for (; nl; nl &= nl - 1)
+                if (block_newline(p + __builtin_ctz(nl), marker, lines, found)) return found;
+            continue;
+        }
+        lines += __builtin_popcount(nl);
+    }
+    return skip_block_scalar(p, end, marker, lines);
+}
+#endif
+
+#if defined(__ARM_NEON)
+const char* skip_block_neon(const char* p, const char* end, std::string_view marker, long& lines) {
+    const uint8x16_t n = vdupq_n_u8('\n'), sc = vdupq_n_u8(';'), key = vdupq_n_u8(marker[2]);
+    const char* found = nullptr;
+    for (; p + 16 + marker.size() < end; p += 16) {
+        uint64_t nl = neon_mask(vceqq_u8(vld1q_u8((const uint8_t*)p), n));
+        if (!nl) continue;
+        uint64_t semi = neon_mask(vceqq_u8(vld1q_u8((const uint8_t*)(p + 1)), sc));
+        uint64_t cand = neon_mask(vceqq_u8(vld1q_u8((const uint8_t*)(p + 3)), key));
+        nl &= 0x1111111111111111ull;
+        if ((nl & ~semi) || (nl & cand)) {
+            for (; nl; nl &= nl - 1)
+                if (block_newline(p + __builtin_ctzll(nl) / 4, marker, lines, found)) return found;
+            continue;
+        }
+        lines += __builtin_popcountll(nl);
+    }
+    return skip_block_scalar(p, end, marker, lines);
+}
+#endif
+
+using ScanFn = LineInfo (*)(const char*, const char*);
+using SkipFn = const char* (*)(const char*, const char*, std::string_view, long&);
+
+// The block skipper that goes with each scanner
+SkipFn skip_fn(ScanIsa isa) {
+    switch (isa) {
+#if defined(__x86_64__) || defined(__i386__)
+        case ScanIsa::Sse2: return skip_block_sse2;
+        case ScanIsa::Avx2: return skip_block_avx2;
+#endif
+#if defined(__ARM_NEON)
+        case ScanIsa::Neon: return skip_block_neon;
+#endif
+        default: return skip_block_scalar;
+    }
+}
+
+// nullptr when this build or CPU can't run it
+ScanFn scan_fn(ScanIsa isa) {
+    switch (isa) {
+        case ScanIsa::Scalar: return scan_line_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+        case ScanIsa::Sse2: return scan_line_sse2;
+        case ScanIsa::Avx2: return __builtin_cpu_supports("avx2") ? scan_line_avx2 : nullptr;
+#endif
+#if defined(__ARM_NEON)
+        case ScanIsa::Neon: return scan_line_neon;
+#endif
+        default: return nullptr;
+    }
+}
+
+ScanIsa best_scan_isa() {
+    for (ScanIsa isa : { ScanIsa::Avx2, ScanIsa::Sse2, ScanIsa::Neon })
+        if (scan_fn(isa)) return isa;
+    return ScanIsa::Scalar;
+}
+
+// The lines of a buffer that hold a command; blank and comment-only lines are skipped
+class LineScanner {
+public:
+    LineScanner(const char* data, size_t size, ScanIsa isa = best_scan_isa())
+        : p(data), end(data + size), scan(scan_fn(isa)), skip(skip_fn(isa)) {}
+
+    // Command text without comment or surrounding blanks. False at end of buffer.
+    bool next(std::string_view& cmd) {
+        while (p < end) {
+            const char* start = p;
+            LineInfo l = scan(p, end);
+            line_no++;
+            p = l.eol < end ? l.eol + 1 : end;
+            if (l.first) { cmd = std::string_view(l.first, l.last - l.first); return true; }
+            if (*start == ';' && l.eol - start > 10) skip_block(std::string_view(start, l.eol - start));
+        }
+        return false;
+    }
+
+    // 1-based file line of the last command returned
+    long line() const { return line_no; }
+
+private:
+    const char* p;
+    const char* end;
+    ScanFn scan;
+    SkipFn skip;
+    long line_no = 0;
+
+    // After a begin marker: on to its end marker, if everything up to it is comments
+    void skip_block(std::string_view line) {
+        for (const auto& [begin, finish] : COMMENT_BLOCKS) {
+            if (line.substr(0, begin.size()) != begin) continue;
+            long lines = 0;
+            if (const char* f = skip(p - 1, end, finish, lines)) { line_no += lines; p = f; }
+            return;
+        }
+    }
+};
+
+long count_commands(const char* data, size_t size, ScanIsa isa = best_scan_isa()) {
+    LineScanner in(data, size, isa);
+    std::string_view cmd;
+    long n = 0;
+    while (in.next(cmd)) n++;
+    return n;
+}
+
+// ---- Real-time mode ----------------------------------------------------------
+// Opt-in (--rt=PRIO): the serial thread runs SCHED_FIFO, optionally pinned with
+// --cpus, with its memory prefaulted and locked so a page fault or a busy
+// neighbour can't stall the stream. Only what is mapped at start is locked,
+// plus each job's IR once compiled — not the job file's mapping or worker
+// stacks. Other threads (daemon control socket) drop back to SCHED_OTHER on
+// --aux-cpus; the IR compile's and pre-flight's workers on every CPU. A probe thread at the same priority
+// measures how late the scheduler wakes it, which is what the sender sees too.
+
+struct RtConfig {
+    int priority = 0;            // 0 = off
+    std::vector<int> cpus, aux_cpus;
+};
+
+// "0,2-3" → {0, 2, 3}
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::istringstream iss(list);
+    for (std::string part; std::getline(iss, part, ','); ) {
+        size_t dash = part.find('-');
+        int lo = std::stoi(part.substr(0, dash));
+        int hi = dash == std::string::npos ? lo : std::stoi(part.substr(dash + 1));
+        for (int c = lo; c <= hi; ++c) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+bool pin_thread(const std::vector<int>& cpus) {
+    if (cpus.empty()) return true;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) CPU_SET(c, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0;
+}
+
+__attribute__((noinline)) void prefault_stack() {
+    volatile char stack[512 * 1024];
+    for (size_t i = 0; i < sizeof stack; i += 4096) stack[i] = 0;
+}
+
+// Keep freed memory in the heap instead of returning it to the kernel, touch
+// enough stack and heap for a whole job, then lock it all in. False if the
+// lock failed; the pages are still touched.
+bool prefault_and_lock() {
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    prefault_stack();
+    const size_t heap = 16 << 20;
+    char* p = (char*)malloc(heap);
+    if (p) { for (size_t i = 0; i < heap; i += 4096) p[i] = 0; free(p); }
+    if (mlockall(MCL_CURRENT) != 0) {
+        std::cerr << "mlockall: " << strerror(errno) << " — memory not locked\n";
+        return false;
+    }
+    return true;
+}
+
+void enter_realtime(const RtConfig& rt) {
+    if (rt.priority <= 0) return;
+    bool locked = prefault_and_lock();
+    if (!pin_thread(rt.cpus)) std::cerr << "Cannot pin serial thread to --cpus\n";
+    struct sched_param sp{};
+    sp.sched_priority = std::min(rt.priority, sched_get_priority_max(SCHED_FIFO));
+    if (int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp))
+        std::cerr << "SCHED_FIFO: " << strerror(err) << " — running at normal priority\n";
+    else
+        std::cout << "  Real-time: SCHED_FIFO " << sp.sched_priority << (locked ? ", memory locked\n" : ", memory NOT locked\n");
+}
+
+void unpin_thread() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c = 0; c < CPU_SETSIZE && c < (int)std::thread::hardware_concurrency(); ++c) CPU_SET(c, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+}
+
+// For helper threads, which inherit the serial thread's policy and CPUs
+void leave_realtime(const RtConfig& rt) {
+    if (rt.priority <= 0) return;
+    struct sched_param sp{};
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+    if (!rt.aux_cpus.empty()) pin_thread(rt.aux_cpus);
+    else unpin_thread();
+}
+
+// For the IR compile's and pre-flight's workers, which don't know the RtConfig:
+// one at a time on the serial thread's CPU at its priority would starve it
+void leave_realtime_worker() {
+    int policy;
+    struct sched_param sp{};
+    if (pthread_getschedparam(pthread_self(), &policy, &sp) != 0 || policy == SCHED_OTHER) return;
+    sp.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+    unpin_thread();
+}
+
+// Wakes every millisecond at the serial thread's priority and CPUs and
+// records how late each wakeup was.
+class LatencyProbe {
+public:
+    explicit LatencyProbe(const RtConfig& rt) : t([this, rt] { loop(rt); }) {}
+    ~LatencyProbe() { stop = true; t.join(); }
+
+    void reset() { max_ns = 0; sum_ns = 0; count = 0; }
+    void report() const {
+        if (!count) return;
+        std::cout << "Scheduling latency: max " << max_ns / 1000 << " µs, avg " << sum_ns / count / 1000
+                  << " µs over " << count << " wakeups\n";
+    }
+
+private:
+    std::atomic<bool> stop{false};
+    std::atomic<long> max_ns{0}, sum_ns{0}, count{0};
+    std::thread t;
+
+    void loop(RtConfig rt) {
+        pin_thread(rt.cpus);
+        struct sched_param sp{};
+        sp.sched_priority = std::min(rt.priority, sched_get_priority_max(SCHED_FIFO));
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+
+        struct timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        while (!stop) {
+            next.tv_nsec += 1000000;
+            if (next.tv_nsec >= 1000000000) { next.tv_nsec -= 1000000000; next.tv_sec++; }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long late = (now.tv_sec - next.tv_sec) * 1000000000L + (now.tv_nsec - next.tv_nsec);
+            if (late < 0) late = 0;
+            if (late > max_ns) max_ns = late;
+            sum_ns += late;
+            count++;
+        }
+    }
+};
+
+// ---- Gap / jitter analysis ---------------------------------------------------
+// --jitter[=MS]: time every gap between consecutive writes and between an ok
+// and the write it released, and keep a per-phase breakdown of what the host
+// was doing in between so a long gap can be blamed on IR decoding, a transform,
+// console output or the printer itself.
+
+enum class HostPhase { Decoding, Transforming, Waiting, Writing, Logging, Count };
+const char* const HOST_PHASE_NAMES[] = { "decoding IR", "transforming", "waiting for printer", "writing", "logging" };
+constexpr int NUM_HOST_PHASES = int(HostPhase::Count);
+
+class JitterRecorder {
+public:
+    using Clock = SessionClock;
+    bool enabled = false;
+    double threshold_ms = 50;
+
+    void start() {
+        write_gaps.clear(); ok_gaps.clear(); worst.clear();
+        outliers = 0;
+        have_write = have_ok = false;
+        in_phase.fill(Clock::duration::zero());
+        phase_start = Clock::now();
+    }
+
+    void phase(HostPhase p) {
+        if (!enabled) return;
+        auto now = Clock::now();
+        in_phase[int(current)] += now - phase_start;
+        current = p;
+        phase_start = now;
+    }
+
+    void ok() { if (enabled) { last_ok = Clock::now(); have_ok = true; } }
+
+    void wrote(long file_line) {
+        if (!enabled) return;
+        phase(HostPhase::Writing);
+        auto now = phase_start;
+        if (have_ok) ok_gaps.push_back(float(ms(now - last_ok)));
+        if (have_write) {
+            double gap = ms(now - last_write);
+            write_gaps.push_back(float(gap));
+            if (gap > threshold_ms) {
+                outliers++;
+                Gap g{ gap, file_line, in_phase };
+                int dom = g.dominant();
+                CoutFormat keep;
+                std::cout << "\n  gap " << std::fixed << std::setprecision(1) << gap << " ms before file line " << file_line
+                          << " — " << HOST_PHASE_NAMES[dom] << " " << ms(in_phase[dom]) << " ms\n";
+                worst.push_back(g);
+                std::sort(worst.begin(), worst.end(), [](const Gap& a, const Gap& b) { return a.ms > b.ms; });
+                if (worst.size() > 20) worst.pop_back();
+            }
+        }
+        last_write = now;
+        have_write = true;
+        have_ok = false;
+        in_phase.fill(Clock::duration::zero());
+    }
+
+    void report() const {
+        if (!enabled || write_gaps.empty()) return;
+        CoutFormat keep;
+        std::cout << "\nInter-command gaps over " << write_gaps.size() + 1 << " writes (ms):\n"
+                  << "                 p50      p90      p99    p99.9   p99.99      max\n";
+        print_row("  write→write", write_gaps);
+        print_row("  ok→write   ", ok_gaps);
+        std::cout << std::defaultfloat << "  " << outliers << " gaps above " << threshold_ms << " ms\n";
+        if (worst.empty()) return;
+        std::cout << "Worst " << worst.size() << " gaps:\n";
+        for (const Gap& g : worst) {
+            std::cout << "  " << std::setw(8) << std::fixed << std::setprecision(1) << g.ms << " ms  before line " << std::setw(7) << g.file_line << "  ";
+            for (int p = 0; p < NUM_HOST_PHASES; ++p)
+                if (ms(g.phases[p]) >= 0.1) std::cout << " " << HOST_PHASE_NAMES[p] << " " << ms(g.phases[p]);
+            std::cout << "\n";
+        }
+    }
+
+private:
+    using PhaseTimes = std::array<Clock::duration, NUM_HOST_PHASES>;
+    struct Gap {
+        double ms;
+        long file_line;
+        PhaseTimes phases;
+        int dominant() const { return int(std::max_element(phases.begin(), phases.end()) - phases.begin()); }
+    };
+
+    std::vector<float> write_gaps, ok_gaps;
+    std::vector<Gap> worst;
+    long outliers = 0;
+    PhaseTimes in_phase{};
+    HostPhase current = HostPhase::Decoding;
+    Clock::time_point phase_start, last_write, last_ok;
+    bool have_write = false, have_ok = false;
+
+    static double ms(Clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); }
+
+    static void print_row(const char* name, std::vector<float> v) {
+        if (v.empty()) return;
+        std::sort(v.begin(), v.end());
+        auto pct = [&](double p) { return v[std::min(v.size() - 1, size_t(p / 100.0 * v.size()))]; };
+        CoutFormat keep;
+        std::cout << name << std::fixed << std::setprecision(2);
+        for (double p : { 50.0, 90.0, 99.0, 99.9, 99.99 }) std::cout << std::setw(9) << pct(p);
+        std::cout << std::setw(9) << v.back() << "\n";
+    }
+};
+
+// ---- Metrics ---------------------------------------------------------------
+// Counters the send loop bumps with relaxed atomics; --metrics=PATH has a
+// background thread turn them into a node_exporter textfile every
+// --metrics-interval seconds, so the send loop itself never touches the disk.
+
+struct TempReading {
+    double hotend = NAN, hotend_target = NAN, bed = NAN, bed_target = NAN;
+};
+
+// "ok T:210.1 /210.0 B:60.0 /60.0 @:0" — no allocation, unknown fields skipped.
+// False if there was no temperature in it.
+bool parse_temps(const char* p, TempReading& r) {
+    bool any = false;
+    for (; *p; ++p) {
+        bool tool = p[0] == 'T' && (p[1] == ':' || (p[1] == '0' && p[2] == ':'));
+        bool bedp = p[0] == 'B' && p[1] == ':';
+        if (!tool && !bedp) continue;
+        p = std::strchr(p, ':') + 1;
+        char* end;
+        double cur = std::strtod(p, &end);
+        if (end == p) continue;
+        p = end;
+        while (*p == ' ') p++;
+        double target = NAN;
+        if (*p == '/') { target = std::strtod(p + 1, &end); p = end; }
+        (tool ? r.hotend : r.bed) = cur;
+        (tool ? r.hotend_target : r.bed_target) = target;
+        any = true;
+        if (!*p) break;
+    }
+    return any;
+}
+
+struct Metrics {
+    static constexpr int NUM_BUCKETS = 12;
+    static constexpr double BUCKET_LE_S[NUM_BUCKETS] = { 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5 };
+
+    std::atomic<long> commands{0}, bytes{0};
+    std::atomic<int> window_depth{0}, baud{0};
+    std::atomic<long> ack_buckets[NUM_BUCKETS + 1] = {};   // last one is +Inf
+    std::atomic<long> ack_count{0}, ack_sum_us{0};
+    std::atomic<double> hotend{NAN}, hotend_target{NAN}, bed{NAN}, bed_target{NAN};
+
+    void sent(size_t len) {
+        commands.fetch_add(1, std::memory_order_relaxed);
+        bytes.fetch_add((long)len, std::memory_order_relaxed);
+    }
+
+    void acked(SessionClock::duration latency) {
+        double s = std::chrono::duration<double>(latency).count();
+        int b = 0;
+        while (b < NUM_BUCKETS && s > BUCKET_LE_S[b]) b++;
+        ack_buckets[b].fetch_add(1, std::memory_order_relaxed);
+        ack_count.fetch_add(1, std::memory_order_relaxed);
+        ack_sum_us.fetch_add(long(s * 1e6), std::memory_order_relaxed);
+    }
+
+    void temps(const TempReading& r) {
+        if (!std::isnan(r.hotend)) {
+            hotend.store(r.hotend, std::memory_order_relaxed);
+            hotend_target.store(r.hotend_target, std::memory_order_relaxed);
+        }
+        if (!std::isnan(r.bed)) {
+            bed.store(r.bed, std::memory_order_relaxed);
+            bed_target.store(r.bed_target, std::memory_order_relaxed);
+        }
+    }
+};
+
+// ---- Temperature log ---------------------------------------------------------
+// Every temperature report — the ok of an M105, the W: lines of M109/M190,
+// M155 auto-reports — goes into a ring of samples allocated once per session:
+// a long print costs no allocation, and past CAPACITY (4.5 h of M155 S1) the
+// oldest samples are overwritten. --temp-log=PATH writes the job's samples
+// when it ends: CSV for a .csv path, else packed binary — a TempLogHeader,
+// then count TempSamples, little-endian as the host writes them.
+
+struct TempSample {
+    double t;                                          // seconds since the job started
+    float hotend, hotend_target, bed, bed_target;      // NAN: not in that report
+};
+
+struct TempLogHeader {
+    char magic[4] = { 'E', '3', 'T', 'L' };
+    uint32_t version = 1;
+    uint32_t sample_size = sizeof(TempSample);
+    uint32_t dropped = 0;                              // overwritten before the save
+    uint64_t count = 0;
+};
+
+class TempLog {
+public:
+    static constexpr size_t CAPACITY = 1 << 14;
+
+    TempLog() : ring(new TempSample[CAPACITY]) {}
+
+    void start(SessionClock::time_point t) { t0 = t; n = 0; }
+    double seconds(SessionClock::time_point t) const { return std::chrono::duration<double>(t - t0).count(); }
+
+    void add(SessionClock::time_point at, const TempReading& r) {
+        ring[n++ % CAPACITY] = { seconds(at), (float)r.hotend, (float)r.hotend_target, (float)r.bed, (float)r.bed_target };
+    }
+
+    size_t size() const { return std::min(n, CAPACITY); }
+    size_t dropped() const { return n - size(); }
+    // Oldest first
+    const TempSample& operator[](size_t i) const { return ring[(dropped() + i) % CAPACITY]; }
+    const TempSample* latest() const { return n ? &ring[(n - 1) % CAPACITY] : nullptr; }
+
+    bool save(const std::string& path) const {
+        std::string ext = std::filesystem::path(path).extension().string();
+        for (char& c : ext) c = std::tolower(c);
+        std::ofstream f(path, std::ios::binary | std::ios::trunc);
+        if (ext == ".csv") {
+            f << "t_s,hotend,hotend_target,bed,bed_target\n" << std::fixed;
+            auto field = [&](float v) { f << ','; if (!std::isnan(v)) f << std::setprecision(2) << v; };
+            for (size_t i = 0; i < size(); ++i) {
+                const TempSample& x = (*this)[i];
+                f << std::setprecision(3) << x.t;
+                field(x.hotend); field(x.hotend_target); field(x.bed); field(x.bed_target);
+                f << '\n';
+            }
+        } else {
+            TempLogHeader h;
+            h.dropped = (uint32_t)dropped();
+            h.count = size();
+            f.write(reinterpret_cast<const char*>(&h), sizeof h);
+            // The ring in at most two runs
+            size_t first = dropped() % CAPACITY, run = std::min(size(), CAPACITY - first);
+            f.write(reinterpret_cast<const char*>(&ring[first]), run * sizeof(TempSample));
+            f.write(reinterpret_cast<const char*>(&ring[0]), (size() - run) * sizeof(TempSample));
+        }
+        return bool(f.flush());
+    }
+
+private:
+    std::unique_ptr<TempSample[]> ring;
+    size_t n = 0;
+    SessionClock::time_point t0;
+};
+
+class StatusPublisher;
+
+// One open connection to the printer. Line numbers and link state carry over
+// from job to job so a queue of prints pays for the connect (and the reset it
+// causes) only once.
+struct Session {
+    int fd = -1;
+    Transport transport = Transport::Serial;
+    SerialIo* io = nullptr;
+    int baud = 0;
+    int line_num = 1;
+    int resend_streak = 0, timeout_streak = 0;
+    LinkMonitor link;
+    RtConfig rt;
+    LatencyProbe* probe = nullptr;
+    JitterRecorder jitter;
+    Metrics metrics;
+    TempLog temp_log;
+    StatusPublisher* status = nullptr;
+
+    // Shared with the daemon's control thread
+    std::atomic<int> sent{0}, total{0};
+    std::atomic<bool> cancel{false};
+    std::atomic<bool> pause{false};   // also set from signal handlers
+};
+
+enum class JobResult { Done, NoFile, LinkLost, Cancelled, Rejected };
+
+// ---- Status segment ----------------------------------------------------------
+// --shm=/ender3 publishes the job's state in a POSIX shared-memory segment
+// (/dev/shm/ender3) for dashboards to poll instead of parsing stdout. The send
+// loop rewrites it after every command: a memcpy between two bumps of a
+// sequence number — no syscall, no lock. A reader copies the data out and
+// keeps the copy only if the number was even and unchanged around it (a
+// seqlock), so any number of readers can poll as often as they like and the
+// streamer never waits for one. Fields are fixed-width and only ever
+// appended; size says how much of StatusData the writer knows. --shm-read
+// is a reader.
+
+enum class StatusState : int32_t { Idle, Printing, Finishing, Paused, Cancelling };
+const char* const STATUS_STATE_NAMES[] = { "idle", "printing", "finishing", "paused", "cancelling" };
+
+struct StatusData {
+    int32_t state;               // StatusState
+    int32_t baud;
+    int32_t window_depth;        // commands in flight
+    int32_t layer, layers;       // layer 0: before the first
+    int64_t file_line;           // of the last command sent
+    int64_t marlin_line;         // N the next command gets
+    int64_t sent, total;         // commands of the job
+    int64_t resends, timeouts;   // this connection
+    double z;
+    double hotend, hotend_target, bed, bed_target;   // NaN until reported
+    double elapsed_s, eta_s;     // eta_s < 0: unknown
+    int64_t updated_ns;          // CLOCK_REALTIME; an old one means the streamer is gone
+    char file[256];
+};
+
+struct StatusSegment {
+    static constexpr uint32_t MAGIC = 0x54533345;   // "E3ST"
+    static constexpr uint32_t VERSION = 1;
+    uint32_t magic, version, size, pid;
+    std::atomic<uint64_t> seq;   // odd while an update is being written
+    StatusData data;
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the seqlock counter is shared between processes");
+
+// Where a layer starts and how far into the job that is
+struct LayerMark {
+    long file_line;              // of the move up to it
+    float z;
+    double before_s;             // estimate_seconds() of everything before it
+};
+
+// A consistent copy of seg's data, zero-filled past what the writer knows.
+// False if every try met an update in progress.
+bool read_status(const StatusSegment* seg, StatusData& out) {
+    size_t known = std::min(sizeof out, size_t(seg->size) - offsetof(StatusSegment, data));
+    for (int tries = 0; tries < 10000; ++tries) {
+        uint64_t before = seg->seq.load(std::memory_order_acquire);
+        if (before & 1) continue;
+        std::memset(&out, 0, sizeof out);
+        std::memcpy(&out, &seg->data, known);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seg->seq.load(std::memory_order_relaxed) == before) return true;
+    }
+    return false;
+}
+
+class StatusPublisher {
+public:
+    StatusPublisher() = default;
+    StatusPublisher(const StatusPublisher&) = delete;
+    StatusPublisher& operator=(const StatusPublisher&) = delete;
+    ~StatusPublisher() {
+        if (!seg) return;
+        munmap(seg, sizeof *seg);
+        shm_unlink(name.c_str());
+    }
+
+    // Fails if the segment exists and isn't a status segment left by a
+    // streamer that has since died: two writers would tear each other's seqlock
+    bool open(std::string shm_name) {
+        name = shm_name[0] == '/' ? shm_name : "/" + shm_name;
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0 && errno == EEXIST && stale()) {
+            shm_unlink(name.c_str());
+            fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        }
+        if (fd < 0) return false;
+        bool ok = ftruncate(fd, sizeof(StatusSegment)) == 0;
+        void* m = ok ? mmap(nullptr, sizeof(StatusSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (m == MAP_FAILED) return false;
+        seg = new (m) StatusSegment{ StatusSegment::MAGIC, StatusSegment::VERSION, sizeof(StatusSegment), (uint32_t)getpid(), {0}, {} };
+        d.hotend = d.hotend_target = d.bed = d.bed_target = NAN;
+        d.eta_s = -1;
+        return true;
+    }
+
+    // An existing segment of ours whose writer is gone
+    bool stale() const {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        struct stat st{};
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)offsetof(StatusSegment, data)) {
+            if (fd >= 0) close(fd);
+            return false;
+        }
+        void* m = mmap(nullptr, offsetof(StatusSegment, data), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (m == MAP_FAILED) return false;
+        auto* old = (const StatusSegment*)m;
+        bool ours = old->magic == StatusSegment::MAGIC;
+        pid_t pid = (pid_t)old->pid;
+        munmap(m, offsetof(StatusSegment, data));
+        bool alive = ours && (kill(pid, 0) == 0 || errno != ESRCH);
+        if (alive) std::cerr << name << " is in use by the streamer with pid " << pid << "\n";
+        errno = EEXIST;   // for the caller's message when it isn't stale
+        return ours && !alive;
+    }
+
+    void begin_job(const std::string& file, std::vector<LayerMark> marks, double estimate) {
+        layers = std::move(marks);
+        estimate_s = estimate;
+        started = first_layer = SessionClock::now();
+        d.state = int32_t(StatusState::Printing);
+        d.layer = 0;
+        d.layers = (int32_t)layers.size();
+        d.z = 0;
+        d.file_line = 0;
+        std::snprintf(d.file, sizeof d.file, "%s", file.c_str());
+    }
+
+    void state(StatusState st) { d.state = int32_t(st); }
+
+    // Everything current from s; file_line is the command just sent, 0 if none was
+    void publish(const Session& s, int depth, long file_line = 0) {
+        auto now = SessionClock::now();
+        if (file_line > 0) {
+            d.file_line = file_line;
+            while (d.layer < d.layers && layers[d.layer].file_line <= file_line) {
+                d.z = layers[d.layer++].z;
+                if (d.layer == 1) first_layer = now;
+            }
+        }
+        d.baud = s.baud;
+        d.window_depth = depth;
+        d.marlin_line = s.line_num;
+        d.sent = s.sent;
+        d.total = s.total;
+        d.resends = s.link.resends;
+        d.timeouts = s.link.timeouts;
+        d.hotend = s.metrics.hotend;
+        d.hotend_target = s.metrics.hotend_target;
+        d.bed = s.metrics.bed;
+        d.bed_target = s.metrics.bed_target;
+        d.elapsed_s = std::chrono::duration<double>(now - started).count();
+        d.eta_s = eta(now);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        d.updated_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+        uint64_t n = seg->seq.load(std::memory_order_relaxed);
+        seg->seq.store(n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(&seg->data, &d, sizeof d);
+        seg->seq.store(n + 2, std::memory_order_release);
+    }
+
+private:
+    std::string name;
+    StatusSegment* seg = nullptr;
+    StatusData d{};
+    std::vector<LayerMark> layers;
+    double estimate_s = 0;
+    SessionClock::time_point started, first_layer;
+
+    // The estimate of what's left, stretched by how much slower than the
+    // estimate the layers so far went (it ignores acceleration). Heating and
+    // homing come before the first layer and don't count.
+    double eta(SessionClock::time_point now) const {
+        if (d.state == int32_t(StatusState::Idle) || estimate_s <= 0) return -1;
+        if (layers.empty()) return d.total ? estimate_s * double(d.total - d.sent) / d.total : -1;
+        if (d.layer == 0) return estimate_s - layers[0].before_s;
+        double done = layers[d.layer - 1].before_s - layers[0].before_s;
+        double took = std::chrono::duration<double>(now - first_layer).count();
+        double stretch = done > 60 ? std::max(1.0, took / done) : 1.0;
+        return (estimate_s - layers[d.layer - 1].before_s) * stretch;
+    }
+};
+
+// Tell Marlin which line number comes next, so numbering stays continuous
+// whatever happened before (fresh boot, previous job, emergency reset).
+bool sync_line_numbers(Session& s, bool debug) {
+    std::string cmd = "M110 N" + std::to_string(s.line_num - 1) + "\n";
+    s.io->write(cmd);
+    if (debug) std::cout << ">> " << cmd;
+    for (std::string resp; !(resp = s.io->read_line()).empty(); ) {
+        if (debug) std::cout << "<< " << resp << "\n";
+        if (resp.find("ok") != std::string::npos) return true;
+    }
+    return false;
+}
+
+// ---- Protocol engine -------------------------------------------------------
+// The host side of the Marlin protocol as C++20 coroutines on one thread. A
+// reader task turns printer lines into acks and resend replays; everything
+// else (the G-code sender, the M105 poller) is plain sequential code that
+// co_awaits window_slot(), ok_for() or sleep_for(). Engine::run() multiplexes
+// them over the SerialIo with one wait at a time — no threads, no blocking
+// outside that wait.
+
+struct Task {
+    struct promise_type {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        Task get_return_object() { return Task{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                auto c = h.promise().continuation;
+                return c ? c : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : h(handle) {}
+    Task(Task&& o) noexcept : h(std::exchange(o.h, {})) {}
+    Task(const Task&) = delete;
+    ~Task() { if (h) h.destroy(); }
+
+    // co_await on a Task runs it to completion as a subroutine
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept { h.promise().continuation = c; return h; }
+    void await_resume() { if (h.promise().error) std::rethrow_exception(h.promise().error); }
+};
+
+// Commands whose ok Marlin holds back until something physical is done: their
+// ack time is that wait, not the link's round trip
+bool waits_in_marlin(const std::string& gcode) {
+    int num = 0;
+    if (gcode.size() < 2 || std::from_chars(gcode.data() + 1, gcode.data() + gcode.size(), num).ec != std::errc()) return false;
+    char letter = (char)std::toupper((unsigned char)gcode[0]);
+    if (letter == 'G') return num == 4 || num == 28 || num == 29 || num == 76;
+    return letter == 'M' && (num == 0 || num == 1 || num == 109 || num == 190 || num == 191 || num == 303 ||
+                             num == 400 || num == 600);
+}
+
+class Engine {
+public:
+    using Clock = SessionClock;
+
+    Engine(Session& session, int window, bool debug) : s(session), window(std::max(1, window)), debug(debug) {}
+
+    void spawn(Task t, bool background = false) { tasks.push_back({ std::move(t), background }); }
+
+    // Run until every foreground task has finished. False if the printer stopped answering.
+    bool run() {
+        spawn(reader(), true);
+        for (auto& t : tasks) ready.push_back(t.task.h);
+
+        while (true) {
+            while (!ready.empty()) {
+                auto h = ready.front();
+                ready.pop_front();
+                h.resume();
+            }
+            bool busy = false;
+            for (auto& t : tasks) {
+                if (t.task.h.done() && t.task.h.promise().error) std::rethrow_exception(t.task.h.promise().error);
+                if (!t.background && !t.task.h.done()) busy = true;
+            }
+            if (!busy) return !lost;
+
+            auto deadline = line_waiter ? line_deadline : Clock::now() + std::chrono::seconds(10);
+            if (!timers.empty()) deadline = std::min(deadline, timers.begin()->first);
+            auto ms = std::chrono::ceil<std::chrono::milliseconds>(deadline - Clock::now()).count();
+
+            // At most 200 ms, so a cancel is seen even while Marlin says nothing (M109)
+            std::string resp = s.io->read_line(int(std::clamp<long long>(ms, 0, 200)));
+            auto now = Clock::now();
+            if (s.cancel && cancel_seen == Clock::time_point()) { cancel_seen = now; interrupt(); }
+            if (s.pause && !s.cancel && pause_seen == Clock::time_point()) { pause_seen = now; interrupt(); }
+            if (!resp.empty()) lines.push_back(resp);
+            if (line_waiter && (!lines.empty() || now >= line_deadline)) {
+                if (!lines.empty()) { line_result = lines.front(); lines.pop_front(); }
+                else line_result.clear();
+                ready.push_back(std::exchange(line_waiter, {}));
+            }
+            while (!timers.empty() && timers.begin()->first <= now) {
+                ready.push_back(timers.begin()->second);
+                timers.erase(timers.begin());
+            }
+        }
+    }
+
+    // Frame, write and track one command. Returns its sequence number for ok_for().
+    long send(const std::string& gcode) {
+        Sent c{ ++seq, s.line_num++, gcode, "", Clock::now() };
+        c.framed = frame_line(c.line, gcode);
+        s.io->write(c.framed);
+        s.metrics.sent(c.framed.size());
+        if (debug) std::cout << ">> " << c.framed.substr(0, c.framed.size()-1) << "\n";
+        in_flight.push_back(std::move(c));
+        s.metrics.window_depth.store((int)in_flight.size(), std::memory_order_relaxed);
+        return seq;
+    }
+
+    long last_seq() const { return seq; }
+    bool link_lost() const { return lost; }
+    bool is_acked(long n) const { return n <= acked; }
+    bool has_slot() const { return (int)in_flight.size() < window; }
+    Clock::time_point cancel_time() const { return cancel_seen; }
+    // Mean ack time in ms of the commands that don't wait inside Marlin
+    double ms_per_ok() const { return round_trips ? round_trip_sum / round_trips : 0; }
+
+    // When the pause was first seen, by the run loop or, if the sender got to
+    // it first, now. No more interrupts for it until pause_done().
+    Clock::time_point pause_time() {
+        if (pause_seen == Clock::time_point()) pause_seen = Clock::now();
+        return pause_seen;
+    }
+    void pause_done() { pause_seen = {}; }
+    long unknown_commands() const { return unknown; }
+
+    // Bypasses the window and the line numbers: for M410, M108 and the like,
+    // which Marlin's emergency parser acts on as they come in, however full
+    // its queue. It still queues them and acks them in turn; that ok is swallowed.
+    void send_emergency(const std::string& gcode) {
+        std::string line = gcode + "\n";
+        s.io->write(line);
+        s.io->flush();
+        swallow_oks++;
+        if (debug) std::cout << ">> " << gcode << "\n";
+    }
+
+    // Wakes every window_slot() and ok_for() waiter with false, and answers
+    // new ones the same way until rearm()
+    void interrupt() {
+        interrupted = true;
+        for (auto h : slot_waiters) ready.push_back(h);
+        for (auto& w : ok_waiters) ready.push_back(w.second);
+        slot_waiters.clear();
+        ok_waiters.clear();
+    }
+    void rearm() { interrupted = false; }
+    size_t depth() const { return in_flight.size(); }
+    const std::string& temps() const { return last_temps; }
+
+    // ---- Awaitables ----
+
+    // Next line from the printer, or "" after 10 s of silence
+    auto next_line() {
+        struct Awaiter {
+            Engine& e;
+            bool await_ready() {
+                if (e.lines.empty()) return false;
+                e.line_result = e.lines.front();
+                e.lines.pop_front();
+                return true;
+            }
+            void await_suspend(std::coroutine_handle<> h) { e.line_waiter = h; e.line_deadline = Clock::now() + std::chrono::seconds(10); }
+            std::string await_resume() { return std::move(e.line_result); }
+        };
+        return Awaiter{ *this };
+    }
+
+    // Room for one more command in the window. False if the link is gone or on interrupt().
+    auto window_slot() {
+        struct Awaiter {
+            Engine& e;
+            bool await_ready() { return e.lost || e.interrupted || (int)e.in_flight.size() < e.window; }
+            void await_suspend(std::coroutine_handle<> h) { e.slot_waiters.push_back(h); }
+            bool await_resume() { return !e.lost && !e.interrupted; }
+        };
+        return Awaiter{ *this };
+    }
+
+    // Command n (a send() result) has been acked. False if the link is gone or on interrupt().
+    auto ok_for(long n) {
+        struct Awaiter {
+            Engine& e;
+            long n;
+            bool await_ready() { return e.lost || e.interrupted || n <= e.acked; }
+            void await_suspend(std::coroutine_handle<> h) { e.ok_waiters.emplace(n, h); }
+            bool await_resume() { return !e.lost && !e.interrupted; }
+        };
+        return Awaiter{ *this, n };
+    }
+
+    auto sleep_for(std::chrono::milliseconds d) {
+        struct Awaiter {
+            Engine& e;
+            Clock::time_point until;
+            bool await_ready() { return false; }
+            void await_suspend(std::coroutine_handle<> h) { e.timers.emplace(until, h); }
+            void await_resume() {}
+        };
+        return Awaiter{ *this, Clock::now() + d };
+    }
+
+private:
+    struct Sent { long seq; int line; std::string gcode, framed; Clock::time_point at; };
+    struct Owned { Task task; bool background; };
+
+    Session& s;
+    int window;
+    bool debug;
+
+    std::vector<Owned> tasks;
+    std::deque<std::coroutine_handle<>> ready, slot_waiters;
+    std::multimap<long, std::coroutine_handle<>> ok_waiters;
+    std::multimap<Clock::time_point, std::coroutine_handle<>> timers;
+    std::coroutine_handle<> line_waiter;
+    Clock::time_point line_deadline;
+    std::deque<std::string> lines;
+    std::string line_result, last_temps;
+
+    std::deque<Sent> in_flight;
+    long seq = 0, acked = 0, unknown = 0;
+    long round_trips = 0;
+    double round_trip_sum = 0;   // ms
+    bool lost = false;
+    bool interrupted = false;
+    Clock::time_point cancel_seen, pause_seen;
+    int swallow_oks = 0;       // Marlin follows every Resend: with an ok that acks nothing
+    int ignore_resends = 0;    // stale lines already sent behind a bad one each ask again
+    long replay_from = -1;
+
+    void acked_through(long n) {
+        acked = std::max(acked, n);
+        s.metrics.window_depth.store((int)in_flight.size(), std::memory_order_relaxed);
+        while (!slot_waiters.empty() && (int)in_flight.size() < window) {
+            ready.push_back(slot_waiters.front());
+            slot_waiters.pop_front();
+        }
+        while (!ok_waiters.empty() && ok_waiters.begin()->first <= acked) {
+            ready.push_back(ok_waiters.begin()->second);
+            ok_waiters.erase(ok_waiters.begin());
+        }
+    }
+
+    void fail() {
+        lost = true;
+        for (auto h : slot_waiters) ready.push_back(h);
+        for (auto& w : ok_waiters) ready.push_back(w.second);
+        slot_waiters.clear();
+        ok_waiters.clear();
+    }
+
+    Task reader() {
+        while (!lost) {
+            std::string resp = co_await next_line();
+            if (resp.empty()) { on_timeout(); continue; }
+            s.timeout_streak = 0;
+            if (debug) std::cout << "<< " << resp << "\n";
+
+            bool stale = ignore_resends > 0 && (resp.find("Line Number") != std::string::npos || parse_resend(resp) == replay_from);
+            if (!stale) classify_response(resp, s.link);
+            if (resp.find("Unknown command") != std::string::npos) unknown++;
+
+            // ok T:… answers M105; " T:… W:?" lines come every second while M109/M190 wait
+            size_t t = resp.find("T:");
+            if (t != std::string::npos && (resp.rfind("ok", 0) == 0 || resp.find_first_not_of(' ') == t)) {
+                last_temps.assign(resp, t);
+                TempReading r;
+                if (parse_temps(resp.c_str() + t, r)) {
+                    s.metrics.temps(r);
+                    s.temp_log.add(Clock::now(), r);
+                }
+                if (s.status) s.status->publish(s, (int)in_flight.size());
+            }
+
+            if (resp.rfind("ok", 0) == 0) on_ok();
+            else if (long n = parse_resend(resp); n >= 0) on_resend(n);
+        }
+    }
+
+    void on_ok() {
+        if (swallow_oks > 0) { swallow_oks--; return; }
+        if (in_flight.empty()) return;   // duplicate from a timeout resend
+        s.jitter.ok();
+        auto latency = Clock::now() - in_flight.front().at;
+        s.metrics.acked(latency);
+        if (!waits_in_marlin(in_flight.front().gcode)) {
+            round_trips++;
+            round_trip_sum += std::chrono::duration<double, std::milli>(latency).count();
+        }
+        long n = in_flight.front().seq;
+        in_flight.pop_front();
+        s.resend_streak = 0;
+        acked_through(n);
+    }
+
+    void on_resend(long line) {
+        swallow_oks++;
+        if (ignore_resends > 0 && line == replay_from) { ignore_resends--; return; }
+
+        // Marlin has everything before line — those oks got lost
+        long n = acked;
+        while (!in_flight.empty() && in_flight.front().line < line) { n = in_flight.front().seq; in_flight.pop_front(); }
+        acked_through(n);
+        if (in_flight.empty()) return;
+
+        if (++s.resend_streak >= 3) {
+            emergency_reset(*s.io, debug);
+            s.line_num = 1; s.resend_streak = 0;
+            swallow_oks = 0; ignore_resends = 0; replay_from = -1;
+            for (auto& c : in_flight) { c.line = s.line_num++; c.framed = frame_line(c.line, c.gcode); }
+        } else {
+            ignore_resends = int(in_flight.size()) - 1;
+            replay_from = line;
+        }
+        for (auto& c : in_flight) s.io->write(c.framed);
+    }
+
+    void on_timeout() {
+        if (in_flight.empty()) return;   // nothing owed to us — we're just idle
+        s.link.record(LinkEvent::Timeout);
+        if (++s.timeout_streak > 1) { std::cerr << "\nTimeout!\n"; fail(); return; }
+        s.io->write(in_flight.front().framed);
+    }
+};
+
+// ---- Transform pipeline --------------------------------------------------------
+// Commands are parsed once into CommandBatch — structure-of-arrays: letters,
+// numbers and fixed-point parameter values each in their own array — and the
+// transforms run over a whole batch at a time, so each stage is a tight loop
+// over a few cache-resident arrays instead of a string parse per line. Stages
+// run in the order their options appear on the command line, and an override
+// that isn't given has no stage at all.
+
+struct CommandBatch {
+    static constexpr int8_t NO_VALUE = -1, RAW = -2;   // p_dec for "X" and for unparsed text
+    static constexpr char TEXT = ' ';                  // p_letter of free text (M117 …)
+
+    // Per command
+    std::vector<char> letter;          // 0: not a command we could parse, kept as text
+    std::vector<int> number;
+    std::vector<int8_t> sub;           // G38.2 → 2, -1 if none
+    std::vector<uint32_t> first;       // its parameters are [first, first + count)
+    std::vector<uint16_t> count;
+    std::vector<uint8_t> tag;          // StartLine::Tag
+    std::vector<uint8_t> dropped;
+    std::vector<long> file_line;
+
+    // Per parameter; p_letter 0 means removed
+    std::vector<char> p_letter;
+    std::vector<long long> p_mant;     // value, or for RAW: arena offset << 16 | length
+    std::vector<int8_t> p_dec;         // decimals, NO_VALUE or RAW
+
+    std::string arena;
+    int line_base = 0;                 // Marlin line number the first command would get
+
+    size_t size() const { return letter.size(); }
+
+    void clear() {
+        letter.clear(); number.clear(); sub.clear(); first.clear(); count.clear(); tag.clear(); dropped.clear(); file_line.clear();
+        p_letter.clear(); p_mant.clear(); p_dec.clear(); arena.clear();
+    }
+
+    void add(std::string_view cmd, long line, uint8_t t = 0) {
+        const char* p = cmd.data();
+        const char* end = p + cmd.size();
+        char l = (char)std::toupper((unsigned char)*p);
+        int num = 0;
+        int8_t sb = -1;
+        auto r = std::from_chars(p + 1, end, num);
+        bool ok = std::isalpha((unsigned char)l) && r.ec == std::errc();
+        if (ok && r.ptr < end && *r.ptr == '.') {
+            int v = 0;
+            auto rs = std::from_chars(r.ptr + 1, end, v);
+            ok = rs.ec == std::errc() && v < 100;
+            sb = (int8_t)v;
+            r.ptr = rs.ptr;
+        }
+        ok = ok && (r.ptr == end || std::isspace((unsigned char)*r.ptr));
+        start(ok ? l : 0, num, sb, line, t);
+
+        if (!ok || takes_text(l, num)) {
+            if (ok) p = r.ptr + (r.ptr < end);
+            if (p < end) raw(TEXT, p, end);
+        } else {
+            for (p = r.ptr; p < end; ) {
+                if (std::isspace((unsigned char)*p)) { p++; continue; }
+                const char* t0 = p;
+                while (p < end && !std::isspace((unsigned char)*p)) p++;
+                char c = (char)std::toupper((unsigned char)*t0);
+                Decimal d;
+                if (!std::isalpha((unsigned char)c)) raw(TEXT, t0, p);
+                else if (p == t0 + 1) param(c, 0, NO_VALUE);
+                else if (parse_decimal(t0 + 1, p, d)) param(c, d.mant, (int8_t)d.decimals);
+                else raw(c, t0 + 1, p);
+            }
+        }
+        finish();
+    }
+
+    // A command built without parsing: start(), its param()/raw(), finish()
+    void start(char l, int num, int8_t sb, long line, uint8_t t = 0) {
+        letter.push_back(l);
+        number.push_back(num);
+        sub.push_back(sb);
+        first.push_back((uint32_t)p_letter.size());
+        tag.push_back(t);
+        dropped.push_back(0);
+        file_line.push_back(line);
+    }
+    void param(char c, long long mant, int8_t dec) { p_letter.push_back(c); p_mant.push_back(mant); p_dec.push_back(dec); }
+    void raw(char c, const char* b, const char* e) {
+        size_t len = std::min<size_t>(e - b, 0xFFFF);
+        param(c, (long long)arena.size() << 16 | len, RAW);
+        arena.append(b, len);
+    }
+    void finish() { count.push_back(uint16_t(p_letter.size() - first.back())); }
+
+    Decimal value(size_t j) const { return { p_mant[j], p_dec[j] }; }
+    std::string_view raw_text(size_t j) const { return std::string_view(arena).substr(p_mant[j] >> 16, p_mant[j] & 0xFFFF); }
+    bool has_value(size_t j) const { return p_dec[j] >= 0; }
+    void set(size_t j, Decimal d) { p_mant[j] = d.mant; p_dec[j] = (int8_t)d.decimals; }
+
+    // The shortest text Marlin reads the same: one space between words, no comment
+    void append_text(size_t i, std::string& out) const {
+        if (letter[i]) {
+            out += letter[i];
+            char buf[16];
+            out.append(buf, std::to_chars(buf, buf + sizeof buf, number[i]).ptr);
+            if (sub[i] >= 0) { out += '.'; out += std::to_string(sub[i]); }
+        }
+        for (size_t j = first[i]; j < first[i] + count[i]; ++j) {
+            if (!p_letter[j]) continue;
+            if (!out.empty()) out += ' ';
+            if (p_letter[j] != TEXT) out += p_letter[j];
+            if (p_dec[j] == RAW) out += raw_text(j);
+            else if (p_dec[j] >= 0) append_decimal(out, value(j));
+        }
+    }
+};
+
+class TransformStage {
+public:
+    virtual ~TransformStage() = default;
+    virtual const char* name() const = 0;
+    virtual void run(CommandBatch& b) = 0;
+    virtual void report(double /*ms_per_ok*/) const {}
+};
+
+// --feedrate: every F, scaled in fixed point with the input's decimals
+class FeedrateStage : public TransformStage {
+public:
+    FeedrateStage(int percent, bool debug) : percent(percent), debug(debug) {}
+    const char* name() const override { return "feedrate"; }
+    void run(CommandBatch& b) override {
+        for (size_t j = 0; j < b.p_letter.size(); ++j) {
+            if (b.p_letter[j] != 'F' || !b.has_value(j)) continue;
+            Decimal to = scale_decimal(b.value(j), percent, 100);
+            if (debug) {
+                std::string from, out;
+                append_decimal(from, b.value(j));
+                append_decimal(out, to);
+                std::cout << "   Feedrate " << from << " → " << out << "\n";
+            }
+            b.set(j, to);
+        }
+    }
+private:
+    int percent;
+    bool debug;
+};
+
+// --bed / --hotend: S of M140/M190 and M104/M109
+class TemperatureStage : public TransformStage {
+public:
+    TemperatureStage(int bed, int hotend) : bed(bed), hotend(hotend) {}
+    const char* name() const override { return "temps"; }
+    void run(CommandBatch& b) override {
+        for (size_t i = 0; i < b.size(); ++i) {
+            if (b.letter[i] != 'M') continue;
+            int n = b.number[i];
+            int force = (n == 140 || n == 190) ? bed : (n == 104 || n == 109) ? hotend : -1;
+            if (force < 0) continue;
+            for (size_t j = b.first[i]; j < b.first[i] + b.count[i]; ++j)
+                if (b.p_letter[j] == 'S' && b.p_dec[j] != CommandBatch::NO_VALUE) b.set(j, { force, 0 });
+        }
+    }
+private:
+    int bed, hotend;
+};
+
+// --flow: E of G0-G3 and G92. Scaling every E — absolute or relative, moves and
+// G92 — by the same factor scales every extrusion by it, so no mode is needed.
+class FlowStage : public TransformStage {
+public:
+    explicit FlowStage(Decimal percent) : percent(percent) {}
+    const char* name() const override { return "flow"; }
+    void run(CommandBatch& b) override {
+        for (size_t i = 0; i < b.size(); ++i) {
+            if (b.letter[i] != 'G' || !((b.number[i] >= 0 && b.number[i] <= 3) || b.number[i] == 92) || b.sub[i] >= 0) continue;
+            for (size_t j = b.first[i]; j < b.first[i] + b.count[i]; ++j)
+                if (b.p_letter[j] == 'E' && b.has_value(j)) b.set(j, scale_percent(b.value(j), percent));
+        }
+    }
+private:
+    Decimal percent;
+};
+
+// --z-offset: Z of G0-G3 while coordinates are absolute (G90). G92 passes
+// through as written; a G92 Z given while the head sits raised by the offset
+// takes the offset into Marlin's coordinates, so the moves after it go out
+// unchanged until the next G28 homes Z.
+class ZOffsetStage : public TransformStage {
+public:
+    explicit ZOffsetStage(Decimal offset) : offset(offset) {}
+    const char* name() const override { return "z-offset"; }
+    void run(CommandBatch& b) override {
+        for (size_t i = 0; i < b.size(); ++i) {
+            if (b.letter[i] != 'G' || b.sub[i] >= 0) continue;
+            int n = b.number[i];
+            size_t z = b.first[i] + b.count[i];
+            bool xy = false;
+            for (size_t j = b.first[i]; j < b.first[i] + b.count[i]; ++j) {
+                if (b.p_letter[j] == 'Z') z = j;
+                else if (b.p_letter[j] == 'X' || b.p_letter[j] == 'Y') xy = true;
+            }
+            bool has_z = z < b.first[i] + b.count[i];
+            if (n == 90 || n == 91) relative = n == 91;
+            else if (n == 28 && (has_z || !xy)) raised = absorbed = false;
+            else if (n == 92 && has_z) absorbed = raised;
+            else if (n >= 0 && n <= 3 && has_z && !relative && b.has_value(z)) {
+                if (!absorbed) b.set(z, add_decimal(b.value(z), offset));
+                raised = true;
+            }
+        }
+    }
+private:
+    Decimal offset;
+    bool relative = false;
+    bool raised = false;     // the head is off the file's Z by the offset
+    bool absorbed = false;   // a G92 made that Marlin's own coordinates
+};
+
+bool same_decimal(Decimal a, Decimal b) {
+    int d = std::max(a.decimals, b.decimals);
+    return a.mant * pow10(d - a.decimals) == b.mant * pow10(d - b.decimals);
+}
+
+// --dedupe tracks Marlin's modal state and drops commands that wouldn't change
+// it, or strips the parameters equal to it: F equal to the current feedrate,
+// axes already at their position (or 0 in relative mode), fan and heater
+// targets already set, repeated G90/G91/M82/M83/G92. Each dropped command is
+// one ok round-trip less. Any command not understood here (G28, G29, T, M600,
+// …) forgets the state, so the output moves, extrudes, heats and cools exactly
+// like the input. Values compare as decimals, so X10 and X10.0 are the same.
+class DedupeStage : public TransformStage {
+public:
+    const char* name() const override { return "dedupe"; }
+
+    void run(CommandBatch& b) override {
+        std::string before;
+        for (size_t i = 0; i < b.size(); ++i) {
+            if (b.dropped[i]) continue;
+            if (!b.letter[i] || b.sub[i] >= 0) { forget(); continue; }   // G38.2 and friends
+            size_t had = live(b, i);
+            removed_bytes = 0;
+            apply(b, i);
+            if (live(b, i) == had && !b.dropped[i]) continue;
+            if (b.dropped[i]) {
+                std::string rest;
+                b.append_text(i, rest);
+                dropped++;
+                bytes_saved += frame_line(b.line_base + int(i), rest).size() + removed_bytes;
+            } else {
+                trimmed++;
+                bytes_saved += removed_bytes;
+            }
+        }
+    }
+
+    void report(double ms_per_ok) const override {
+        if (!dropped && !trimmed) return;
+        CoutFormat keep;
+        std::cout << "Redundant: " << dropped << " commands dropped, " << trimmed << " shortened, "
+                  << bytes_saved << " bytes and " << dropped << " ok round-trips saved";
+        if (ms_per_ok > 0) std::cout << std::fixed << std::setprecision(1) << " (≈" << dropped * ms_per_ok / 1000
+                                     << " s at " << ms_per_ok << " ms per ok)";
+        std::cout << "\n";
+    }
+
+private:
+    struct Known { Decimal v; bool known = false; };
+    Known pos[4], feed, hotend, bed;          // pos: X Y Z E
+    int rel_xyz = -1, rel_e = -1;             // -1 = unknown
+    std::map<int, Decimal> fans;
+    long dropped = 0, trimmed = 0, bytes_saved = 0;
+    size_t removed_bytes = 0;
+
+    static size_t live(const CommandBatch& b, size_t i) {
+        size_t n = 0;
+        for (size_t j = b.first[i]; j < b.first[i] + b.count[i]; ++j) n += b.p_letter[j] != 0;
+        return n;
+    }
+    static int axis(char p) { return p == 'X' ? 0 : p == 'Y' ? 1 : p == 'Z' ? 2 : p == 'E' ? 3 : -1; }
+    static bool same(const Known& k, Decimal v) { return k.known && same_decimal(k.v, v); }
+
+    // Commands that touch none of the tracked state
+    static bool keeps_state(char letter, int num) {
+        if (letter == 'G') return num == 4 || num == 20 || num == 21;
+        if (letter != 'M') return false;
+        switch (num) {
+            case 73: case 105: case 114: case 115: case 117: case 118: case 155: case 201: case 203:
+            case 204: case 205: case 220: case 221: case 400: case 900: return true;
+            default: return false;
+        }
+    }
+
+    void forget() {
+        for (auto& p : pos) p.known = false;
+        feed.known = hotend.known = bed.known = false;
+        rel_xyz = rel_e = -1;
+        fans.clear();
+    }
+
+    void strip(CommandBatch& b, size_t j) {
+        std::string t;
+        t += ' ';
+        t += b.p_letter[j];
+        append_decimal(t, b.value(j));
+        removed_bytes += t.size();
+        b.p_letter[j] = 0;
+    }
+
+    // Updates the state from command i; may strip its parameters or drop it
+    void apply(CommandBatch& b, size_t i) {
+        char letter = b.letter[i];
+        int num = b.number[i];
+        size_t j0 = b.first[i], j1 = j0 + b.count[i];
+        if (keeps_state(letter, num)) return;
+        bool modelled = letter == 'G' ? (num <= 3 || num == 90 || num == 91 || num == 92)
+                      : letter == 'M' && (num == 82 || num == 83 || num == 106 || num == 107 ||
+                                          num == 104 || num == 109 || num == 140 || num == 190);
+        if (!modelled) { forget(); return; }
+        for (size_t j = j0; j < j1; ++j)
+            if (b.p_letter[j] && !b.has_value(j)) { forget(); return; }
+
+        bool drop = false;
+        if (letter == 'G' && num <= 3) {
+            for (size_t j = j0; j < j1; ++j) {
+                char p = b.p_letter[j];
+                if (!p) continue;
+                Decimal v = b.value(j);
+                bool eq = false;
+                if (p == 'F') { eq = same(feed, v); feed = { v, true }; }
+                else if (int a = axis(p); a >= 0) {
+                    int rel = a == 3 ? rel_e : rel_xyz;
+                    if (rel == 1) { eq = v.mant == 0; if (!eq) pos[a].known = false; }   // Marlin sums in float — don't guess
+                    else if (rel == 0) { eq = same(pos[a], v); pos[a] = { v, true }; }
+                    else pos[a].known = false;
+                }
+                if (eq) strip(b, j);
+            }
+            drop = num <= 1 && live(b, i) == 0;
+        }
+        else if (letter == 'G' && (num == 90 || num == 91)) {
+            int rel = num == 91;
+            drop = rel_xyz == rel && rel_e == rel;
+            rel_xyz = rel_e = rel;
+        }
+        else if (letter == 'M' && (num == 82 || num == 83)) {
+            int rel = num == 83;
+            drop = rel_e == rel;
+            rel_e = rel;
+        }
+        else if (letter == 'G' && num == 92) {
+            drop = true;
+            bool any = false;
+            for (size_t j = j0; j < j1; ++j) {
+                int a = axis(b.p_letter[j]);
+                if (a < 0) { forget(); return; }
+                drop &= same(pos[a], b.value(j));
+                pos[a] = { b.value(j), true };
+                any = true;
+            }
+            if (!any) drop = false;   // Marlin 2 ignores a bare G92; pass it on, assume nothing
+        }
+        else if (letter == 'M' && (num == 106 || num == 107)) {
+            int p = 0;
+            Decimal s{ num == 107 ? 0 : 255, 0 };
+            for (size_t j = j0; j < j1; ++j) {
+                if (b.p_letter[j] == 'P' && b.has_value(j) && b.p_dec[j] == 0) p = (int)b.p_mant[j];
+                else if (b.p_letter[j] == 'S' && num == 106 && b.has_value(j)) s = b.value(j);
+                else { fans.clear(); return; }
+            }
+            auto it = fans.find(p);
+            drop = it != fans.end() && same_decimal(it->second, s);
+            fans[p] = s;
+        }
+        else if (letter == 'M' && (num == 104 || num == 109 || num == 140 || num == 190)) {
+            Known& target = (num == 140 || num == 190) ? bed : hotend;
+            if (b.count[i] != 1 || !(b.p_letter[j0] == 'S' || (b.p_letter[j0] == 'R' && (num == 109 || num == 190))))
+                target.known = false;   // T, B, F — leave those alone
+            else {
+                drop = (num == 104 || num == 140) && same(target, b.value(j0));   // waits still wait
+                target = { b.value(j0), true };
+            }
+        }
+
+        if (drop) b.dropped[i] = 1;
+    }
+};
+
+class TransformPipeline {
+public:
+    explicit TransformPipeline(const Overrides& ov) {
+        for (const auto& name : ov.stages) {
+            if (name == "feedrate") stages.push_back(std::make_unique<FeedrateStage>(ov.feedrate_percent, ov.debug));
+            else if (name == "temps") stages.push_back(std::make_unique<TemperatureStage>(ov.bed_temp, ov.hotend_temp));
+            else if (name == "flow") stages.push_back(std::make_unique<FlowStage>(ov.flow_percent));
+            else if (name == "z-offset") stages.push_back(std::make_unique<ZOffsetStage>(ov.z_offset));
+            else if (name == "dedupe") stages.push_back(std::make_unique<DedupeStage>());
+        }
+    }
+
+    void run(CommandBatch& b) { for (auto& st : stages) st->run(b); }
+    void report(double ms_per_ok) const { for (auto& st : stages) st->report(ms_per_ok); }
+
+private:
+    std::vector<std::unique_ptr<TransformStage>> stages;
+};
+
+// ---- Compact G-code IR -----------------------------------------------------------
+// A file is parsed once, into a byte stream every later pass reads instead of
+// the text: pre-flight, the layer index, the time estimate, the transform
+// pipeline and the sender. Per command an opcode varint (number << 3 |
+// G/M/T/raw << 1 | extended), a bitmask of the parameters present — X, Y, Z, E
+// and F in the low bits so it is one byte for moves — and per parameter a
+// fixed-point value as the zigzag delta from that letter's previous one, or
+// the mantissa and decimals when those changed. "Extended" adds a byte of flags
+// for a file-line gap (comments in between), a sub-code (G38.2) or free text.
+// "G1 X105.873 Y95.372 E.02339" takes 9-10 bytes. The stream is cut into
+// segments that restart the deltas: parts of a file compile on their own core
+// and concatenate, pre-flight decodes them in parallel, and a layer is a
+// segment plus a few commands away. --compile saves it as .gir, which is
+// loaded as is.
+
+const char IR_LETTERS[] = "XYZEFSPIJRTABCDGHKLMNOQUVW";   // mask bit order
+const char IR_MAGIC[4] = { 'G', 'I', 'R', '1' };
+constexpr uint32_t IR_SEGMENT = 4096;                     // commands per segment
+
+inline int ir_bit(char c) {
+    static const std::array<int8_t, 26> bits = [] {
+        std::array<int8_t, 26> b{};
+        for (int i = 0; i < 26; ++i) b[IR_LETTERS[i] - 'A'] = (int8_t)i;
+        return b;
+    }();
+    return bits[c - 'A'];
+}
+
+inline void put_varint(std::string& out, uint64_t v) {
+    for (; v >= 0x80; v >>= 7) out += char(v | 0x80);
+    out += char(v);
+}
+
+inline uint64_t get_varint(const char*& p) {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t b = (uint8_t)*p++;
+        v |= uint64_t(b & 0x7F) << shift;
+        if (b < 0x80) return v;
+    }
+}
+
+inline uint64_t zigzag(long long v) { return uint64_t(v) << 1 ^ uint64_t(v >> 63); }
+inline long long unzigzag(uint64_t v) { return (long long)(v >> 1) ^ -(long long)(v & 1); }
+
+inline double to_double(Decimal d) { return double(d.mant) / double(pow10(d.decimals)); }
+
+struct IrSegment {
+    uint64_t offset;     // into GcodeIr::code
+    uint32_t command;    // index of its first command
+    uint32_t line;       // file line its first command's gap counts from
+};
+
+struct IrLayer {
+    uint32_t command;    // the move that went up to it
+    float z;
+};
+
+struct GcodeIr {
+    std::string code;
+    std::vector<IrSegment> segments;
+    std::vector<IrLayer> layers;
+    uint32_t commands = 0;
+    uint32_t lines = 0;          // of the source file
+    uint64_t text_bytes = 0;
+    double load_ms = 0;
+    int threads = 1;
+
+    // Bytes held per command, indexes included
+    double bytes_per_command() const {
+        size_t total = code.size() + segments.size() * sizeof(IrSegment) + layers.size() * sizeof(IrLayer);
+        return commands ? double(total) / commands : 0;
+    }
+
+    // .gir: the magic, six u64 counts, then segments, layers and code as they
+    // are in memory (host byte order — it is a cache, not an exchange format)
+    bool save(const std::string& path) const {
+        std::ofstream f(path, std::ios::binary | std::ios::trunc);
+        uint64_t head[6] = { commands, lines, text_bytes, segments.size(), layers.size(), code.size() };
+        f.write(IR_MAGIC, 4);
+        f.write((const char*)head, sizeof head);
+        f.write((const char*)segments.data(), segments.size() * sizeof(IrSegment));
+        f.write((const char*)layers.data(), layers.size() * sizeof(IrLayer));
+        f.write(code.data(), code.size());
+        return bool(f);
+    }
+
+    bool read(const char* p, size_t size) {
+        uint64_t head[6];
+        if (size < 4 + sizeof head || std::memcmp(p, IR_MAGIC, 4) != 0) return false;
+        std::memcpy(head, p + 4, sizeof head);
+        size_t need = 4 + sizeof head + head[3] * sizeof(IrSegment) + head[4] * sizeof(IrLayer) + head[5];
+        if (need != size) return false;
+        commands = (uint32_t)head[0]; lines = (uint32_t)head[1]; text_bytes = head[2];
+        p += 4 + sizeof head;
+        segments.assign((const IrSegment*)p, (const IrSegment*)p + head[3]);
+        p += head[3] * sizeof(IrSegment);
+        layers.assign((const IrLayer*)p, (const IrLayer*)p + head[4]);
+        p += head[4] * sizeof(IrLayer);
+        code.assign(p, head[5]);
+        return true;
+    }
+};
+
+// Appends commands to an IR, a new segment every IR_SEGMENT of them
+class IrWriter {
+public:
+    explicit IrWriter(GcodeIr& ir) : ir(ir) {}
+
+    void put(const CommandBatch& b, size_t i) {
+        if (ir.commands % IR_SEGMENT == 0) {
+            ir.segments.push_back({ ir.code.size(), ir.commands, (uint32_t)prev_line });
+            std::fill(std::begin(dec), std::end(dec), CommandBatch::RAW);   // no delta across segments
+        }
+        ir.commands++;
+
+        // Raw: not G/M/T, a repeated letter or stray text — kept as the text
+        int kind = b.letter[i] == 'G' ? 0 : b.letter[i] == 'M' ? 1 : b.letter[i] == 'T' ? 2 : 3;
+        if (b.number[i] < 0) kind = 3;
+        uint32_t mask = 0;
+        int text = -1;
+        uint32_t at[26];
+        for (size_t j = b.first[i]; j < b.first[i] + b.count[i] && kind != 3; ++j) {
+            char c = b.p_letter[j];
+            if (!c) continue;
+            if (c == CommandBatch::TEXT) {
+                if (text >= 0 || !takes_text(b.letter[i], b.number[i])) kind = 3;
+                text = (int)j;
+                continue;
+            }
+            int bit = ir_bit(c);
+            if (mask >> bit & 1) kind = 3;
+            mask |= 1u << bit;
+            at[bit] = (uint32_t)j;
+        }
+        std::string_view free;
+        if (kind == 3) { scratch.clear(); b.append_text(i, scratch); free = scratch; }
+        else if (text >= 0) free = b.raw_text(text);
+
+        std::string& out = ir.code;
+        uint64_t gap = uint64_t(b.file_line[i] - prev_line - 1);
+        prev_line = b.file_line[i];
+        unsigned flags = (kind != 3 && b.sub[i] >= 0) | (gap != 0) << 1 | (kind == 3 || text >= 0) << 2;
+        put_varint(out, uint64_t(kind == 3 ? 0 : b.number[i]) << 3 | kind << 1 | (flags != 0));
+        if (flags) out += char(flags);
+        if (flags & 1) out += char(b.sub[i]);
+        if (flags & 2) put_varint(out, gap);
+        if (flags & 4) { put_varint(out, free.size()); out += free; }
+        if (kind == 3) return;
+
+        put_varint(out, mask);
+        for (; mask; mask &= mask - 1) {
+            int bit = __builtin_ctz(mask);
+            size_t j = at[bit];
+            if (b.p_dec[j] == CommandBatch::NO_VALUE) out += char(2);
+            else if (b.p_dec[j] == CommandBatch::RAW) {
+                std::string_view v = b.raw_text(j);
+                put_varint(out, uint64_t(v.size()) << 2 | 3);
+                out += v;
+            }
+            else if (b.p_dec[j] == dec[bit]) {
+                put_varint(out, zigzag(b.p_mant[j] - mant[bit]) << 2);
+                mant[bit] = b.p_mant[j];
+            }
+            else {
+                put_varint(out, zigzag(b.p_mant[j]) << 2 | 1);
+                out += char(b.p_dec[j]);
+                mant[bit] = b.p_mant[j];
+                dec[bit] = b.p_dec[j];
+            }
+        }
+    }
+
+private:
+    GcodeIr& ir;
+    long long mant[26] = {};
+    int8_t dec[26] = {};
+    long prev_line = 0;
+    std::string scratch;
+};
+
+// Decodes an IR, or the segments [first, last) of one, into CommandBatches
+class IrReader {
+public:
+    explicit IrReader(const GcodeIr& ir, size_t first = 0, size_t last = SIZE_MAX) : ir(ir) {
+        last = std::min(last, ir.segments.size());
+        end_cmd = last < ir.segments.size() ? ir.segments[last].command : ir.commands;
+        seg = first;
+        cmd = first < ir.segments.size() ? ir.segments[first].command : ir.commands;
+    }
+
+    // Appends up to max - b.size() commands to b. False if there were none left.
+    bool read(CommandBatch& b, size_t max) {
+        size_t before = b.size();
+        for (; b.size() < max && cmd < end_cmd; ++cmd) {
+            if (seg < ir.segments.size() && cmd == ir.segments[seg].command) start(seg++);
+            uint64_t op = get_varint(p);
+            int kind = op >> 1 & 3;
+            unsigned flags = op & 1 ? (uint8_t)*p++ : 0;
+            int8_t sb = flags & 1 ? (int8_t)*p++ : -1;
+            if (flags & 2) line += (long)get_varint(p);
+            line++;
+            const char* text = nullptr;
+            size_t text_len = 0;
+            if (flags & 4) { text_len = get_varint(p); text = p; p += text_len; }
+            if (kind == 3) {
+                b.start(0, 0, -1, line);
+                b.raw(CommandBatch::TEXT, text, text + text_len);
+                b.finish();
+                continue;
+            }
+            b.start("GMT"[kind], int(op >> 3), sb, line);
+            for (uint64_t mask = get_varint(p); mask; mask &= mask - 1) {
+                int bit = __builtin_ctzll(mask);
+                char c = IR_LETTERS[bit];
+                uint64_t v = get_varint(p);
+                switch (v & 3) {
+                    case 0: mant[bit] += unzigzag(v >> 2); b.param(c, mant[bit], dec[bit]); break;
+                    case 1: mant[bit] = unzigzag(v >> 2); dec[bit] = (int8_t)*p++; b.param(c, mant[bit], dec[bit]); break;
+                    case 2: b.param(c, 0, CommandBatch::NO_VALUE); break;
+                    case 3: b.raw(c, p, p + (v >> 2)); p += v >> 2; break;
+                }
+            }
+            if (text) b.raw(CommandBatch::TEXT, text, text + text_len);
+            b.finish();
+        }
+        return b.size() > before;
+    }
+
+    // Index of the next command read() returns
+    uint32_t position() const { return cmd; }
+
+private:
+    void start(size_t s) {
+        p = ir.code.data() + ir.segments[s].offset;
+        line = ir.segments[s].line;
+    }
+
+    const GcodeIr& ir;
+    size_t seg;
+    uint32_t cmd, end_cmd;
+    const char* p = nullptr;
+    long line = 0;
+    long long mant[26] = {};
+    int8_t dec[26] = {};
+};
+
+// "N12 G1 X5*71" → "G1 X5": every line is numbered and checksummed on the way out anyway
+std::string_view strip_framing(std::string_view cmd) {
+    if (cmd.size() > 1 && (cmd[0] == 'N' || cmd[0] == 'n') && std::isdigit((unsigned char)cmd[1])) {
+        size_t k = 1;
+        while (k < cmd.size() && (std::isdigit((unsigned char)cmd[k]) || scan_blank(cmd[k]))) k++;
+        cmd.remove_prefix(k);
+    }
+    size_t star = cmd.find('*');
+    if (star != std::string_view::npos) {
+        cmd = cmd.substr(0, star);
+        while (!cmd.empty() && scan_blank(cmd.back())) cmd.remove_suffix(1);
+    }
+    return cmd;
+}
+
+// Whole lines [p, end) into part, with line numbers counted from p
+void compile_part(const char* p, const char* end, GcodeIr& part) {
+    LineScanner in(p, end - p);
+    IrWriter w(part);
+    CommandBatch b;
+    std::string_view cmd;
+    for (bool more = true; more; ) {
+        b.clear();
+        while (b.size() < 1024 && (more = in.next(cmd))) {
+            cmd = strip_framing(cmd);
+            if (!cmd.empty()) b.add(cmd, in.line());
+        }
+        for (size_t i = 0; i < b.size(); ++i) w.put(b, i);
+    }
+    part.lines = (uint32_t)in.line();
+}
+
+// Where the head is, command by command: G90/G91, M82/M83, G92 and G28
+struct HeadState {
+    double pos[4] = { 0, 0, 0, 0 };    // X Y Z E, logical
+    double feed = 1500;                // mm/min
+    bool relative = false, relative_e = false;
+
+    // Applies command i; true for G0-G3, with where it started in from
+    bool apply(const CommandBatch& b, size_t i, double from[4]) {
+        char letter = b.letter[i];
+        int num = b.number[i];
+        if (letter == 'M' && (num == 82 || num == 83)) relative_e = num == 83;
+        if (letter != 'G' || b.sub[i] >= 0) return false;
+        if (num == 90 || num == 91) { relative = relative_e = num == 91; return false; }
+        bool move = num >= 0 && num <= 3;
+        if (!move && num != 92 && num != 28) return false;
+        std::copy(pos, pos + 4, from);
+        bool any = false;
+        for (size_t j = b.first[i]; j < b.first[i] + b.count[i]; ++j) {
+            char c = b.p_letter[j];
+            if (c == 'F' && b.has_value(j) && move) feed = to_double(b.value(j));
+            int a = c == 'X' ? 0 : c == 'Y' ? 1 : c == 'Z' ? 2 : c == 'E' ? 3 : -1;
+            if (a < 0) continue;
+            any = true;
+            double v = b.has_value(j) ? to_double(b.value(j)) : 0;
+            if (num == 28) pos[a] = 0;
+            else if (move && (a == 3 ? relative_e : relative)) pos[a] += v;
+            else pos[a] = v;
+        }
+        if (!any && num == 28) pos[0] = pos[1] = pos[2] = 0;
+        return move;
+    }
+};
+
+// A layer starts where Z goes above every layer so far and the head then
+// extrudes there; z-hops travel up and come back down without extruding
+void index_layers(GcodeIr& ir) {
+    ir.layers.clear();
+    IrReader in(ir);
+    CommandBatch b;
+    HeadState head;
+    double from[4], top = -1;
+    uint32_t raised = 0;
+    for (uint32_t at = 0; b.clear(), in.read(b, 1024); ) {
+        for (size_t i = 0; i < b.size(); ++i, ++at) {
+            if (!head.apply(b, i, from)) continue;
+            if (head.pos[2] != from[2]) raised = at;
+            if (head.pos[3] > from[3] && head.pos[2] > top + 1e-4) {
+                top = head.pos[2];
+                ir.layers.push_back({ raised, (float)top });
+            }
+        }
+    }
+}
+
+// Seconds of motion at the commanded feedrates, capped by the machine's, plus
+// G4 dwells — no acceleration and no heating, so a lower bound. With marks:
+// where each of ir.layers starts, and the estimate up to there.
+double estimate_seconds(const GcodeIr& ir, const MachineLimits& lim, std::vector<LayerMark>* marks = nullptr) {
+    IrReader in(ir);
+    CommandBatch b;
+    HeadState head;
+    double from[4], s = 0;
+    size_t layer = 0;
+    for (uint32_t at = 0; b.clear(), in.read(b, 1024); ) {
+        for (size_t i = 0; i < b.size(); ++i, ++at) {
+            if (marks && layer < ir.layers.size() && ir.layers[layer].command == at)
+                marks->push_back({ b.file_line[i], ir.layers[layer++].z, s });
+            if (b.letter[i] == 'G' && b.number[i] == 4) {
+                for (size_t j = b.first[i]; j < b.first[i] + b.count[i]; ++j) {
+                    if (!b.has_value(j)) continue;
+                    if (b.p_letter[j] == 'P') s += to_double(b.value(j)) / 1000;
+                    if (b.p_letter[j] == 'S') s += to_double(b.value(j));
+                }
+                continue;
+            }
+            if (!head.apply(b, i, from)) continue;
+            double d[4];
+            for (int a = 0; a < 4; ++a) d[a] = head.pos[a] - from[a];
+            double len = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            double ci = 0, cj = 0;
+            bool arc = b.number[i] >= 2;
+            for (size_t j = b.first[i]; j < b.first[i] + b.count[i] && arc; ++j) {
+                if (b.p_letter[j] == 'I' && b.has_value(j)) ci = to_double(b.value(j));
+                if (b.p_letter[j] == 'J' && b.has_value(j)) cj = to_double(b.value(j));
+            }
+            if (arc && (ci || cj)) {
+                double cx = from[0] + ci, cy = from[1] + cj, r = std::hypot(ci, cj);
+                double sweep = std::atan2(head.pos[1] - cy, head.pos[0] - cx) - std::atan2(from[1] - cy, from[0] - cx);
+                if (b.number[i] == 2 && sweep >= 0) sweep -= 2 * M_PI;
+                if (b.number[i] == 3 && sweep <= 0) sweep += 2 * M_PI;
+                len = std::hypot(std::fabs(sweep) * r, d[2]);
+            }
+            if (len == 0) len = std::fabs(d[3]);   // retract, prime
+            double feed = std::min(head.feed, lim.max_feedrate);
+            if (feed > 0) s += len / (feed / 60);
+        }
+    }
+    return s;
+}
+
+// Parses text into an IR on every core: parts cut at line boundaries, at
+// least 256 KiB each, concatenated in order
+GcodeIr compile_ir(const char* data, size_t size) {
+    auto t0 = std::chrono::steady_clock::now();
+    int n = std::max(1, std::min<int>(std::thread::hardware_concurrency(), int(size / (256 << 10)) + 1));
+    std::vector<const char*> cuts{ data };
+    for (int i = 1; i < n; ++i) {
+        const char* c = data + size * i / n;
+        if (c < cuts.back()) c = cuts.back();
+        const char* nl = (const char*)std::memchr(c, '\n', data + size - c);
+        cuts.push_back(nl ? nl + 1 : data + size);
+    }
+    cuts.push_back(data + size);
+
+    std::vector<GcodeIr> parts(n);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n; ++i)
+        workers.emplace_back([&, i] { leave_realtime_worker(); compile_part(cuts[i], cuts[i + 1], parts[i]); });
+    compile_part(cuts[0], cuts[1], parts[0]);
+    for (auto& w : workers) w.join();
+
+    GcodeIr ir;
+    size_t bytes = 0;
+    for (auto& part : parts) bytes += part.code.size();
+    ir.code.reserve(bytes);
+    for (auto& part : parts) {
+        for (IrSegment sg : part.segments) {
+            sg.offset += ir.code.size();
+            sg.command += ir.commands;
+            sg.line += ir.lines;
+            ir.segments.push_back(sg);
+        }
+        ir.code += part.code;
+        ir.commands += part.commands;
+        ir.lines += part.lines;
+    }
+    ir.text_bytes = size;
+    ir.threads = n;
+    index_layers(ir);
+    ir.load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    return ir;
+}
+
+// The loader: a .gir as saved, anything else compiled from G-code text
+bool load_ir(const std::string& path, GcodeIr& ir) {
+    MappedFile map;
+    if (!map.open(path)) return false;
+    if (map.size >= 4 && std::memcmp(map.data, IR_MAGIC, 4) == 0) {
+        auto t0 = std::chrono::steady_clock::now();
+        if (!ir.read(map.data, map.size)) return false;
+        ir.load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        return true;
+    }
+    ir = compile_ir(map.data, map.size);
+    return true;
+}
+
+std::string format_duration(double s) {
+    long m = std::lround(s / 60);
+    return m >= 60 ? std::to_string(m / 60) + "h" + (m % 60 < 10 ? "0" : "") + std::to_string(m % 60) + "m"
+                   : std::to_string(m) + "m";
+}
+
+void print_ir_summary(const std::string& file, const GcodeIr& ir, const MachineLimits& lim) {
+    CoutFormat keep;
+    std::cout << "Loaded " << file << ": " << ir.commands << " commands, " << ir.layers.size() << " layers, ≈ "
+              << format_duration(estimate_seconds(ir, lim)) << " of moves at the commanded feedrates\n"
+              << std::fixed << std::setprecision(1) << "  " << ir.text_bytes / 1e6 << " MB of text → "
+              << ir.code.size() / 1e6 << " MB IR, " << ir.bytes_per_command() << " bytes per command ("
+              << (ir.text_bytes ? 100.0 * ir.code.size() / ir.text_bytes : 0) << "%), in " << ir.load_ms
+              << " ms on " << ir.threads << " thread(s)\n";
+}
+
+// ---- Start-sequence optimizer ----------------------------------------------
+// --fast-start rewrites the first N commands of a job. Slicer start G-code
+// usually waits for the bed (M190) and only then starts the hotend (M109);
+// both heaters go on together instead, then both waits run back to back. With
+// --stored-mesh, G29 becomes M420 S1 (load the mesh from EEPROM instead of
+// probing). A G28 that re-homes axes which are already homed, with nothing in
+// between that could move them, is dropped. The run measures how long each
+// heater and G28 took and replays the original order against those numbers to
+// report the time saved.
+
+// "M190 S60" → 'M', 190. False for blank lines.
+bool gcode_code(const std::string& cmd, char& letter, int& num) {
+    if (cmd.size() < 2) return false;
+    letter = (char)std::toupper((unsigned char)cmd[0]);
+    return std::from_chars(cmd.data() + 1, cmd.data() + cmd.size(), num).ec == std::errc();
+}
+
+bool gcode_param(const std::string& cmd, char p, double& v) {
+    for (size_t i = cmd.find(' '); i != std::string::npos && i + 1 < cmd.size(); i = cmd.find(' ', i + 1)) {
+        if (std::toupper((unsigned char)cmd[i + 1]) != p) continue;
+        const char* b = cmd.data() + i + 2;
+        v = 0;
+        std::from_chars(b, cmd.data() + cmd.size(), v);
+        return true;
+    }
+    return false;
+}
+
+struct StartLine {
+    enum Tag : uint8_t { None, Heat, BedWait, HotWait, Home };
+    long file_line;
+    std::string gcode;
+    Tag tag = None;
+};
+
+struct StartRewrite {
+    enum Op : uint8_t { BedSet, BedWait, HotSet, HotWait };
+    std::deque<StartLine> lines;       // what to send before reading on from the file
+    std::vector<Op> original;          // heater commands as the slicer ordered them
+    int consumed = 0;                  // commands taken from the file
+    bool merged = false;
+    double hot_target = 0;
+    int homes_dropped = 0, probes_replaced = 0;
+
+    // Filled in while printing
+    SessionClock::time_point heat_start, bed_done, hot_done, hot_reached, home_sent;
+    double home_s = 0;
+};
+
+// Commands that can't move the head or lose its homed position
+bool keeps_position(char letter, int num, const std::string& cmd) {
+    if (letter == 'G') {
+        double v;
+        if (num == 92) return !gcode_param(cmd, 'X', v) && !gcode_param(cmd, 'Y', v) && !gcode_param(cmd, 'Z', v);
+        return num == 4 || num == 20 || num == 21 || num == 90 || num == 91;
+    }
+    return letter == 'M' && num != 18 && num != 84 && num != 206 && num != 290 && num != 420 &&
+           num != 428 && num != 600 && num != 851;
+}
+
+StartRewrite rewrite_start(IrReader& in, int max_commands, bool stored_mesh) {
+    StartRewrite r;
+    std::vector<StartLine> head;
+    CommandBatch batch;
+    in.read(batch, max_commands);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        head.push_back({ batch.file_line[i], "" });
+        batch.append_text(i, head.back().gcode);
+    }
+    r.consumed = (int)head.size();
+
+    char letter;
+    int num;
+    double v;
+    if (stored_mesh)
+        for (auto& h : head)
+            if (gcode_code(h.gcode, letter, num) && letter == 'G' && num == 29) { h.gcode = "M420 S1"; r.probes_replaced++; }
+
+    // The heater run: from the first heater command through non-moving commands only
+    size_t a = 0;
+    while (a < head.size() && !(gcode_code(head[a].gcode, letter, num) && letter == 'M' &&
+                                (num == 104 || num == 109 || num == 140 || num == 190))) a++;
+    size_t b = a;
+    int bed_wait = -1, hot_wait = -1;
+    double bed_t = -1, hot_t = -1;
+    std::string bed_args, hot_args;   // everything after the M-code, the same for a heater's set and wait
+    bool ok = true;
+    for (; b < head.size() && gcode_code(head[b].gcode, letter, num) && keeps_position(letter, num, head[b].gcode); ++b) {
+        if (letter != 'M' || (num != 104 && num != 109 && num != 140 && num != 190)) continue;
+        bool bed = num == 140 || num == 190, wait = num == 109 || num == 190;
+        if (!gcode_param(head[b].gcode, 'S', v)) { ok = false; break; }   // R waits for cooling too — leave those alone
+        std::string args = head[b].gcode.substr(head[b].gcode.find(' '));
+        std::string& have = bed ? bed_args : hot_args;
+        if (!have.empty() && have != args) { ok = false; break; }         // e.g. 150° for probing, full heat later
+        have = args;
+        (bed ? bed_t : hot_t) = v;
+        if (wait) {
+            int& w = bed ? bed_wait : hot_wait;
+            if (w >= 0) { ok = false; break; }
+            w = (int)b;
+        }
+        r.original.push_back(bed ? (wait ? StartRewrite::BedWait : StartRewrite::BedSet)
+                                 : (wait ? StartRewrite::HotWait : StartRewrite::HotSet));
+    }
+    if (ok && bed_wait >= 0 && hot_wait >= 0 && bed_t > 0 && hot_t > 0) {
+        std::vector<StartLine> out(head.begin(), head.begin() + a);
+        long at = head[a].file_line;
+        out.push_back({ at, "M140" + bed_args, StartLine::Heat });
+        out.push_back({ at, "M104" + hot_args });
+        for (size_t i = a; i < b; ++i) {
+            if (gcode_code(head[i].gcode, letter, num) && letter == 'M' && (num == 104 || num == 140)) continue;
+            if ((int)i == std::min(bed_wait, hot_wait)) {
+                out.push_back({ head[bed_wait].file_line, "M190" + bed_args, StartLine::BedWait });
+                out.push_back({ head[hot_wait].file_line, "M109" + hot_args, StartLine::HotWait });
+            }
+            else if ((int)i != bed_wait && (int)i != hot_wait) out.push_back(head[i]);
+        }
+        out.insert(out.end(), head.begin() + b, head.end());
+        head = std::move(out);
+        r.merged = true;
+        r.hot_target = hot_t;
+    }
+    else r.original.clear();
+
+    int homed = 0;   // X/Y/Z bits
+    for (auto& h : head) {
+        if (!gcode_code(h.gcode, letter, num)) continue;
+        if (letter == 'G' && num == 28) {
+            int axes = 0;
+            for (int i = 0; i < 3; ++i) if (gcode_param(h.gcode, "XYZ"[i], v)) axes |= 1 << i;
+            if (!axes) axes = 7;
+            if ((axes & ~homed) == 0) { r.homes_dropped++; continue; }
+            homed |= axes;
+            h.tag = StartLine::Home;
+        }
+        else if (!keeps_position(letter, num, h.gcode)) homed = 0;
+        r.lines.push_back(std::move(h));
+    }
+    return r;
+}
+
+// When the hotend first gets within 1° of its target, from ok and heating reports
+Task watch_hotend(Engine& e, Session& s, StartRewrite& st, double target) {
+    const std::chrono::milliseconds period(200);
+    while (st.hot_done == SessionClock::time_point{}) {
+        co_await e.sleep_for(period);
+        if (st.heat_start == SessionClock::time_point{}) continue;
+        if (s.metrics.hotend.load(std::memory_order_relaxed) >= target - 1) {
+            st.hot_reached = SessionClock::now();
+            co_return;
+        }
+    }
+}
+
+void report_start(const StartRewrite& st) {
+    using secs = std::chrono::duration<double>;
+    std::ostringstream o;
+    o << std::fixed << std::setprecision(0);
+    double saved = 0;
+    if (st.merged && st.hot_done != SessionClock::time_point{}) {
+        double bed = secs(st.bed_done - st.heat_start).count();
+        double done = secs(std::max(st.bed_done, st.hot_done) - st.heat_start).count();
+        bool seen = st.hot_reached != SessionClock::time_point{};
+        double hot = seen ? secs(st.hot_reached - st.heat_start).count() : secs(st.hot_done - st.heat_start).count();
+        double settle = std::max(0.0, done - std::max(bed, hot));   // M109's residency time after reaching target
+
+        // Replay the slicer's order against the measured heat-up times
+        double t = 0, bed_on = -1, hot_on = -1;
+        for (auto op : st.original) {
+            switch (op) {
+                case StartRewrite::BedSet:  if (bed_on < 0) bed_on = t; break;
+                case StartRewrite::HotSet:  if (hot_on < 0) hot_on = t; break;
+                case StartRewrite::BedWait: if (bed_on < 0) bed_on = t; t = std::max(t, bed_on + bed); break;
+                case StartRewrite::HotWait: if (hot_on < 0) hot_on = t; t = std::max(t, hot_on + hot) + settle; break;
+            }
+        }
+        saved += std::max(0.0, t - done);
+        o << "heaters together: bed " << bed << " s, hotend " << hot << " s, ready after " << done
+          << " s instead of ~" << t << " s";
+    }
+    if (st.homes_dropped) {
+        if (o.tellp() > 0) o << "; ";
+        o << st.homes_dropped << " repeated G28 dropped (~" << st.home_s << " s each)";
+        saved += st.homes_dropped * st.home_s;
+    }
+    if (st.probes_replaced) {
+        if (o.tellp() > 0) o << "; ";
+        o << st.probes_replaced << " G29 → M420 S1";
+    }
+    if (o.tellp() == 0) return;
+    o << " — about " << saved << " s saved" << (st.probes_replaced ? " plus probing" : "");
+    std::cout << "Start sequence: " << o.str() << "\n";
+}
+
+// ---- Pause / resume ----------------------------------------------------------
+// SIGUSR1 pauses and SIGUSR2 resumes; Ctrl-Z (SIGTSTP) toggles; the daemon
+// takes PAUSE and RESUME. The engine sees the request within 200 ms, as it
+// does a cancel, and wakes the send loop from a full window or an ok wait, so
+// it stops at the next command. The commands already in flight, up to
+// --window of them (an M109 among them still heats first), and the blocks
+// Marlin has planned still run, so that is how long it takes the head to stop
+// — the pause latency, timed from the request to M400's ok. Then it retracts, lifts, parks and keeps
+// the steppers on with the heaters left alone. Resume goes back over the
+// print, lowers, primes, restores G90/G91, M82/M83 and F, and carries on
+// from the next line. Before the file's first G28 there is nowhere known to
+// park, so the head just stops.
+
+std::atomic<bool>* pause_flag = nullptr;   // Session::pause, for the handlers
+
+void on_pause_signal(int sig) {
+    if (!pause_flag) return;
+    pause_flag->store(sig == SIGTSTP ? !pause_flag->load() : sig == SIGUSR1);
+}
+
+std::string gcode_number(double v) {
+    char buf[32];
+    std::snprintf(buf, sizeof buf, "%.3f", v);
+    std::string r = buf;
+    r.erase(r.find_last_not_of('0') + 1);
+    if (r.back() == '.') r.pop_back();
+    return r;
+}
+
+// Sends cmds through the window and waits for the last one's ok
+Task send_and_wait(Engine& e, const std::vector<std::string>& cmds, bool& ok) {
+    for (const auto& c : cmds) {
+        if (!co_await e.window_slot()) { ok = false; co_return; }
+        e.send(c);
+    }
+    long last = e.last_seq();
+    ok = co_await e.ok_for(last);
+}
+
+// With head as of the last command sent; false if the link went
+Task pause_job(Engine& e, Session& s, const HeadState& head, bool homed, const Overrides& ov, bool& ok) {
+    auto asked = e.pause_time();
+    e.rearm();   // the waits the pause interrupted are the caller's to retry
+    size_t in_flight = e.depth();
+    std::cout << "\n\nPausing: " << in_flight << " command(s) in flight..." << std::flush;
+    if (s.status) { s.status->state(StatusState::Paused); s.status->publish(s, (int)in_flight); }
+    std::vector<std::string> cmds{ "M400" };
+    co_await send_and_wait(e, cmds, ok);
+    if (!ok) co_return;
+    auto stopped = SessionClock::now();
+    {
+        CoutFormat keep;
+        std::cout << std::fixed << std::setprecision(2) << " motion stopped after "
+                  << std::chrono::duration<double>(stopped - asked).count() << " s\n";
+    }
+
+    const std::string retract = gcode_number(ov.pause_retract);
+    const std::string x = gcode_number(head.pos[0]), y = gcode_number(head.pos[1]), z = gcode_number(head.pos[2]);
+    if (homed) {
+        double lift = std::min(head.pos[2] + ov.park[2], ov.limits.max[2]);
+        cmds = { "M83", "G1 E-" + retract + " F2400", "G90", "G1 Z" + gcode_number(lift) + " F600",
+                 "G1 X" + gcode_number(ov.park[0]) + " Y" + gcode_number(ov.park[1]) + " F6000", "M84 S0", "M400" };
+        co_await send_and_wait(e, cmds, ok);
+        if (!ok) co_return;
+        if (s.status) s.status->publish(s, 0);
+        std::cout << "Parked at X" << gcode_number(ov.park[0]) << " Y" << gcode_number(ov.park[1]) << " Z" << gcode_number(lift)
+                  << ", heaters on. Resume with SIGUSR2, Ctrl-Z or RESUME.\n" << std::flush;
+    } else std::cout << "Not homed yet, so not parked. Resume with SIGUSR2, Ctrl-Z or RESUME.\n" << std::flush;
+
+    const std::chrono::milliseconds tick(100);
+    while (s.pause && !s.cancel) co_await e.sleep_for(tick);
+    if (s.cancel) co_return;   // cancelling leaves the head parked
+
+    auto resumed = SessionClock::now();
+    if (homed) {
+        // Over the print first, then down, so the nozzle doesn't drag across it.
+        // M84 S120 puts back Marlin's DEFAULT_STEPPER_DEACTIVE_TIME.
+        cmds = { "G90", "G1 X" + x + " Y" + y + " F6000", "G1 Z" + z + " F600", "M83", "G1 E" + retract + " F2400",
+                 head.relative ? "G91" : "G90", head.relative_e ? "M83" : "M82", "G1 F" + gcode_number(head.feed), "M84 S120", "M400" };
+        co_await send_and_wait(e, cmds, ok);
+        if (!ok) co_return;
+    }
+    {
+        CoutFormat keep;
+        std::cout << std::fixed << std::setprecision(1) << "Resumed after " << std::chrono::duration<double>(resumed - stopped).count()
+                  << " s paused; head back in place in " << std::chrono::duration<double>(SessionClock::now() - resumed).count()
+                  << " s\n";
+    }
+    e.pause_done();
+    if (s.status) { s.status->state(StatusState::Printing); s.status->publish(s, (int)e.depth()); }
+}
+
+// window_slot() with seq < 0, else ok_for(seq); a pause that interrupts the
+// wait parks the head first. ok is false if the link went or on a cancel.
+Task wait_or_pause(Engine& e, Session& s, long seq, const HeadState& head, bool homed, const Overrides& ov, bool& ok) {
+    while (true) {
+        if (seq < 0) ok = co_await e.window_slot();
+        else ok = co_await e.ok_for(seq);
+        if (ok || e.link_lost() || s.cancel) co_return;
+        if (!s.pause) { e.rearm(); e.pause_done(); continue; }   // resumed before we got to it
+        co_await pause_job(e, s, head, homed, ov, ok);
+        if (!ok) co_return;
+    }
+}
+
+// ---- Cancel ------------------------------------------------------------------
+// CANCEL on the daemon socket, or Ctrl-C / SIGTERM (a second one kills the
+// streamer outright), stops the job within 200 ms even while Marlin is silent
+// in M109: the engine's waits are interrupted, nothing more is sent, and M410
+// and M108 go out unnumbered so Marlin's emergency parser throws away the
+// planned moves and breaks an M109/M190 wait as soon as they arrive. What was
+// already in Marlin's command queue — at most --window commands — still runs;
+// M104 S0 and M140 S0 are ordinary commands, so they go out numbered as the
+// window frees up, ahead of the M400 that waits for it to drain, with M108
+// repeated every second for a heat wait further back. Then fan off, the head up
+// and to the park position, steppers off, and an M105 for the final
+// temperatures. Every step has a deadline, so a printer that stops answering
+// costs CANCEL_BUDGET at most.
+
+const auto CANCEL_BUDGET = std::chrono::seconds(30);
+
+std::atomic<bool>* cancel_flag = nullptr;   // Session::cancel, for the handlers
+std::atomic<bool> cancel_signalled{false};  // no more jobs after this one either
+
+void on_cancel_signal(int) {
+    cancel_signalled = true;
+    if (cancel_flag) cancel_flag->store(true);
+}
+
+// Like send_and_wait(), but gives up at deadline. nudge goes out through the
+// emergency parser every second of waiting: M108 for each heat wait still queued.
+Task send_until(Engine& e, const std::vector<std::string>& cmds, SessionClock::time_point deadline, bool& ok,
+                const char* nudge = nullptr) {
+    const std::chrono::milliseconds tick(20);
+    auto next_nudge = SessionClock::now() + std::chrono::seconds(1);
+    auto wait = [&] {
+        if (nudge && SessionClock::now() >= next_nudge) { e.send_emergency(nudge); next_nudge += std::chrono::seconds(1); }
+        return e.sleep_for(tick);
+    };
+    ok = false;
+    for (const auto& c : cmds) {
+        while (!e.has_slot() && !e.link_lost() && SessionClock::now() < deadline) co_await wait();
+        if (!e.has_slot()) co_return;
+        e.send(c);
+    }
+    long last = e.last_seq();
+    while (!e.is_acked(last) && !e.link_lost() && SessionClock::now() < deadline) co_await wait();
+    ok = e.is_acked(last);
+}
+
+// auto_report: M155 S1 is on, and goes off with the rest, inside the budget
+Task cancel_job(Engine& e, Session& s, const HeadState& head, bool homed, bool auto_report, const Overrides& ov, long file_line) {
+    auto seen = e.cancel_time() == SessionClock::time_point() ? SessionClock::now() : e.cancel_time();
+    auto deadline = seen + CANCEL_BUDGET;
+    e.interrupt();   // a cancel from the send loop itself, before run() saw it
+    e.rearm();
+    if (s.status) { s.status->state(StatusState::Cancelling); s.status->publish(s, (int)e.depth(), file_line); }
+    size_t in_flight = e.depth();
+    for (const char* c : { "M410", "M108" }) e.send_emergency(c);
+    auto quickstop = SessionClock::now();
+
+    bool idle = false, ended = false;
+    std::vector<std::string> cmds{ "M104 S0", "M140 S0", "M400" };
+    co_await send_until(e, cmds, deadline, idle, "M108");
+    auto stopped = SessionClock::now();
+    if (!e.link_lost()) {
+        cmds = { "M107" };
+        if (auto_report) cmds.push_back("M155 S0");
+        if (homed) {
+            double lift = std::min(head.pos[2] + ov.park[2], ov.limits.max[2]);
+            for (const char* c : { "G90", "M400" }) cmds.push_back(c);
+            cmds.push_back("G1 Z" + gcode_number(lift) + " F600");
+            cmds.push_back("G1 X" + gcode_number(ov.park[0]) + " Y" + gcode_number(ov.park[1]) + " F6000");
+        }
+        for (const char* c : { "M400", "M84", "M105" }) cmds.push_back(c);
+        co_await send_until(e, cmds, deadline, ended);
+    }
+    auto done = SessionClock::now();
+    auto secs = [&](SessionClock::time_point t) { return std::chrono::duration<double>(t - seen).count(); };
+
+    CoutFormat keep;
+    std::cout << "\n\nJob cancelled after " << s.sent << "/" << s.total << " commands (file line " << file_line << ")\n"
+              << std::fixed << std::setprecision(2)
+              << "  M410 and M108 sent " << secs(quickstop) << " s after the cancel, " << in_flight << " command(s) in flight; ";
+    if (idle) std::cout << "printer idle after " << secs(stopped) << " s\n";
+    else std::cout << "printer not idle after " << secs(stopped) << " s\n";
+    if (ended) std::cout << "  heaters and fan off, " << (homed ? "head lifted and parked, " : "not homed so not moved, ")
+                         << "steppers off — confirmed " << secs(done) << " s after the cancel\n"
+                         << (e.temps().empty() ? "" : "  " + e.temps() + "\n");
+    else std::cout << "  end state NOT confirmed: " << (e.link_lost() ? "link lost" : "no answer within "
+                         + std::to_string(CANCEL_BUDGET.count()) + " s") << " — check the heaters\n";
+}
+
+// ---- Heat waits ----------------------------------------------------------------
+// With --heat-settle=N, M109 S/M190 S go out as M104/M140 and the job waits on
+// the host: it goes on once the temperature log shows the heater has held
+// within TEMP_WINDOW of its target for N seconds, where Marlin would hold it
+// for TEMP_RESIDENCY_TIME (10 s on the Ender 3) after first getting there. As
+// in Marlin, S doesn't wait for a heater that is already above its target. An
+// M105 keeps the log fresh when no auto-report has come in for a while.
+
+constexpr double TEMP_WINDOW = 1;          // TEMP_WINDOW / TEMP_BED_WINDOW
+constexpr double TEMP_RESIDENCY_S = 10;    // TEMP_RESIDENCY_TIME / TEMP_BED_RESIDENCY_TIME
+
+struct HeatWaits {
+    int count = 0;
+    double waited_s = 0, saved_s = 0;
+};
+
+// "M109 S200" → bed false, target 200. False for anything that isn't a heat-up wait.
+bool heat_wait_target(const std::string& cmd, bool& bed, double& target) {
+    char letter;
+    int num;
+    double v;
+    if (!gcode_code(cmd, letter, num) || letter != 'M' || (num != 109 && num != 190)) return false;
+    if (gcode_param(cmd, 'R', v) || !gcode_param(cmd, 'S', target)) return false;
+    bed = num == 190;
+    return true;
+}
+
+// Called once the M104/M140 has been acked; ok false on a cancel or a lost link
+Task hold_until_stable(Engine& e, Session& s, const HeadState& head, bool homed, const Overrides& ov,
+                       bool bed, double target, HeatWaits& stats, bool& ok) {
+    const double settle_s = ov.heat_settle;
+    const std::chrono::milliseconds tick(250);
+    const TempLog& log = s.temp_log;
+    auto reading = [bed](const TempSample& x) { return bed ? x.bed : x.hotend; };
+    auto set_to = [bed, target](const TempSample& x) { float t = bed ? x.bed_target : x.hotend_target; return std::isnan(t) || std::fabs(t - target) < 0.5; };
+
+    double began = log.seconds(SessionClock::now()), reached = -1;
+    long poll = 0;
+    bool judged = false;
+    stats.count++;
+    while (true) {
+        if (s.cancel || e.link_lost()) { ok = false; co_return; }
+        if (s.pause) {
+            co_await pause_job(e, s, head, homed, ov, ok);
+            if (!ok) co_return;
+        }
+        double now = log.seconds(SessionClock::now());
+        const TempSample* last = log.latest();
+        if (last && set_to(*last) && !std::isnan(reading(*last))) {
+            if (!judged && reading(*last) > target) break;
+            judged = true;
+            // How long the newest run of samples has stayed inside the window
+            double held_since = -1;
+            for (size_t i = log.size(); i-- > 0; ) {
+                const TempSample& x = log[i];
+                if (x.t < began - 1) break;
+                if (std::isnan(reading(x))) continue;
+                if (!set_to(x) || std::fabs(reading(x) - target) > TEMP_WINDOW) break;
+                held_since = x.t;
+            }
+            if (held_since >= 0 && reached < 0) reached = held_since;
+            if (held_since >= 0 && now - held_since >= settle_s) break;
+        }
+        if ((!last || now - last->t > 1.5) && (poll == 0 || e.is_acked(poll)) && e.has_slot()) poll = e.send("M105");
+        co_await e.sleep_for(tick);
+    }
+    double done = log.seconds(SessionClock::now());
+    stats.waited_s += done - began;
+    if (reached >= 0) stats.saved_s += std::max(0.0, reached + TEMP_RESIDENCY_S - done);
+}
+
+void report_heat_waits(const HeatWaits& h, double settle_s) {
+    if (!h.count) return;
+    CoutFormat keep;
+    std::cout << std::fixed << std::setprecision(1) << "Heat waits: " << h.count << " held on the host until "
+              << settle_s << " s stable, " << h.waited_s << " s in all; Marlin's " << TEMP_RESIDENCY_S
+              << " s residency would have added ≈ " << h.saved_s << " s\n";
+}
+
+// Feed one file through the engine, window_slot() at a time
+Task send_file(Engine& e, Session& s, IrReader& in, const Overrides& ov, bool quiet, int total, StartRewrite& start, JobResult& result) {
+    int sent = 0;
+    std::string modified;
+    CommandBatch batch;
+    TransformPipeline pipeline(ov);
+    auto fill = [&] {
+        batch.clear();
+        while (batch.size() < 256 && !start.lines.empty()) {
+            auto& l = start.lines.front();
+            batch.add(l.gcode, l.file_line, l.tag);
+            start.lines.pop_front();
+        }
+        in.read(batch, 256);
+        return batch.size() > 0;
+    };
+    JitterRecorder& jit = s.jitter;
+    HeadState head;            // where the commands sent so far leave the head, for pause and cancel
+    bool homed = false;
+    long last_line = 0;
+    double from[4];
+    HeatWaits heat;
+    size_t i = 0;
+
+    // Temperatures once a second without M105 in the window; firmware built
+    // without AUTO_REPORT_TEMPERATURES says "Unknown command" before the ok
+    bool auto_report = false;
+    if (!quiet) {
+        long unknown = e.unknown_commands();
+        long m155 = e.send("M155 S1");
+        bool ok;
+        co_await wait_or_pause(e, s, m155, head, homed, ov, ok);
+        if (!ok) co_return;
+        auto_report = e.unknown_commands() == unknown;
+    }
+    // Moves i to the next command the pipeline kept, transforming a new batch when one runs out
+    auto next = [&] {
+        for (;; ++i) {
+            if (i == batch.size()) {
+                if (!fill()) return false;
+                jit.phase(HostPhase::Transforming);
+                batch.line_base = s.line_num;
+                pipeline.run(batch);
+                i = 0;
+            }
+            if (!batch.dropped[i]) return true;
+            s.total = --total;
+        }
+    };
+    bool ok = true;
+    for (jit.phase(HostPhase::Decoding); next(); jit.phase(HostPhase::Decoding), ++i) {
+        if (s.pause && !s.cancel) {
+            co_await pause_job(e, s, head, homed, ov, ok);
+            if (!ok) break;
+        }
+        if (s.cancel) break;
+        modified.clear();
+        batch.append_text(i, modified);
+        long file_line = batch.file_line[i];
+        auto tag = StartLine::Tag(batch.tag[i]);
+
+        if (int want = s.link.wanted_baud(s.baud)) {
+            // M575 has to go out on an idle line
+            long last = e.last_seq();
+            co_await wait_or_pause(e, s, last, head, homed, ov, ok);
+            if (!ok) break;
+            int from = s.baud;
+            BaudChange r = renegotiate_baud(*s.io, s.baud, want, s.line_num, ov.debug);
+            if (r == BaudChange::Lost || (r == BaudChange::Reverted && !sync_line_numbers(s, ov.debug))) {
+                std::cerr << "Printer lost changing baud rate — job aborted\n";
+                co_return;
+            }
+            if (r != BaudChange::Switched) {
+                std::cout << "Staying at " << s.baud << " baud for this session\n";
+                s.link.refused();
+            }
+            if (s.baud != from) s.link.changed(from, s.baud);
+            s.metrics.baud = s.baud;
+        }
+
+        jit.phase(HostPhase::Waiting);
+        if (tag == StartLine::Home) {
+            // Timed from an idle queue so the G28 is all that's measured
+            long last = e.last_seq();
+            co_await wait_or_pause(e, s, last, head, homed, ov, ok);
+            if (!ok) break;
+        }
+        co_await wait_or_pause(e, s, -1, head, homed, ov, ok);
+        if (!ok) break;
+        bool heat_bed;
+        double heat_target;
+        bool hold = ov.heat_settle > 0 && heat_wait_target(modified, heat_bed, heat_target);
+        if (hold) modified = (heat_bed ? "M140" : "M104") + modified.substr(4);
+
+        jit.phase(HostPhase::Writing);
+        long seq = e.send(modified);
+        jit.wrote(file_line);
+        if (hold) {
+            co_await wait_or_pause(e, s, seq, head, homed, ov, ok);
+            if (ok) co_await hold_until_stable(e, s, head, homed, ov, heat_bed, heat_target, heat, ok);
+            if (!ok) break;
+        }
+        head.apply(batch, i, from);
+        if (batch.letter[i] == 'G' && batch.number[i] == 28) homed = true;
+        last_line = file_line;
+        if (tag != StartLine::None) {
+            auto at = SessionClock::now();
+            if (tag == StartLine::Heat) start.heat_start = at;
+            else {
+                co_await wait_or_pause(e, s, seq, head, homed, ov, ok);
+                if (!ok) break;
+                auto now = SessionClock::now();
+                if (tag == StartLine::BedWait) start.bed_done = now;
+                if (tag == StartLine::HotWait) start.hot_done = now;
+                if (tag == StartLine::Home) start.home_s = std::chrono::duration<double>(now - at).count();
+            }
+        }
+        s.sent = ++sent;
+        if (s.status) s.status->publish(s, (int)e.depth(), file_line);
+        jit.phase(HostPhase::Logging);
+        if (!quiet && (sent % 25 == 0 || ov.debug)) {
+            std::cout << "\rProgress: " << (sent*100/total) << "% (" << sent << "/" << total << ")";
+            if (!e.temps().empty()) std::cout << "  " << e.temps();
+            std::cout << "    " << std::flush;
+        }
+    }
+    if (e.link_lost()) { result = JobResult::LinkLost; co_return; }
+    if (s.cancel) {
+        co_await cancel_job(e, s, head, homed, auto_report, ov, last_line);
+        result = e.link_lost() ? JobResult::LinkLost : JobResult::Cancelled;
+        co_return;
+    }
+
+    if (!quiet) std::cout << "\n\nFinishing... " << std::flush;
+    if (s.status) { s.status->state(StatusState::Finishing); s.status->publish(s, (int)e.depth()); }
+    long m400 = e.send("M400");
+    co_await wait_or_pause(e, s, m400, head, homed, ov, ok);
+    if (!ok) {
+        if (s.cancel && !e.link_lost()) {
+            co_await cancel_job(e, s, head, homed, auto_report, ov, last_line);
+            result = e.link_lost() ? JobResult::LinkLost : JobResult::Cancelled;
+        } else result = JobResult::LinkLost;
+        co_return;
+    }
+    if (auto_report) {
+        const std::vector<std::string> report_off = { "M155 S0" };
+        co_await send_and_wait(e, report_off, ok);
+        if (!ok) { result = JobResult::LinkLost; co_return; }
+    }
+    if (!quiet) std::cout << "done!\n\nPRINT COMPLETED SUCCESSFULLY!\n";
+    report_start(start);
+    report_heat_waits(heat, ov.heat_settle);
+    if (!quiet) pipeline.report(e.ms_per_ok());
+    result = JobResult::Done;
+}
+
+// M105 every interval while the job runs, through the same window as the G-code,
+// unless a report (M155, a heat wait) came in more recently than that
+Task poll_temps(Engine& e, Session& s, int interval_s) {
+    // Built outside the co_await: GCC 12 miscompiles frames holding converted temporaries there
+    const std::chrono::milliseconds period = std::chrono::seconds(interval_s);
+    while (true) {
+        co_await e.sleep_for(period);
+        const TempSample* last = s.temp_log.latest();
+        if (last && s.temp_log.seconds(SessionClock::now()) - last->t < interval_s) continue;
+        if (!co_await e.window_slot()) {
+            if (e.link_lost() || s.cancel) co_return;
+            continue;
+        }
+        e.send("M105");
+    }
+}
+
+// ---- Pre-flight validation ---------------------------------------------------
+// --preflight checks a whole file before the first byte goes to the printer —
+// i.e. before 5 minutes of bed heating — and refuses to start it on errors:
+// syntax Marlin can't parse, moves outside the Ender 3 volume, feedrates and
+// temperatures that are out of range once --feedrate/--bed/--hotend apply.
+// Commands Marlin would answer with "Unknown command" are warnings. It runs
+// over the IR, its segments split across all cores; positions need the
+// G90/G91/G92/G28 history, so chunks only collect compact move records and one
+// cheap sequential pass replays those.
+
+struct PreflightIssue { long line; bool error; std::string what; };
+
+struct PreflightReport {
+    long lines = 0, commands = 0, errors = 0, warnings = 0;
+    std::vector<PreflightIssue> issues;   // sorted by line, capped
+    double ms = 0;
+    int threads = 0;
+};
+
+bool known_gcode(char letter, int num, int sub) {
+    if (letter == 'T') return num >= 0 && num <= 7;
+    if (letter == 'G') {
+        switch (num) {
+            case 0: case 1: case 2: case 3: case 4: case 5: case 6: case 10: case 11: case 12:
+            case 17: case 18: case 19: case 20: case 21: case 26: case 27: case 28: case 29:
+            case 30: case 31: case 32: case 33: case 34: case 35: case 42: case 53: case 54:
+            case 55: case 56: case 57: case 58: case 59: case 60: case 61: case 76: case 80:
+            case 90: case 91: case 92: case 425: return true;
+            case 38: return sub >= 2 && sub <= 5;
+            default: return false;
+        }
+    }
+    static const short m_codes[] = {
+        0, 1, 3, 4, 5, 7, 8, 9, 10, 11, 16, 17, 18, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+        42, 43, 48, 73, 75, 76, 77, 78, 80, 81, 82, 83, 84, 85, 86, 87, 92, 100, 104, 105, 106, 107, 108, 109,
+        110, 111, 112, 113, 114, 115, 117, 118, 119, 120, 121, 122, 123, 125, 126, 127, 128, 129, 140, 141,
+        143, 145, 149, 150, 154, 155, 163, 164, 165, 166, 190, 191, 192, 193, 200, 201, 203, 204, 205, 206,
+        207, 208, 209, 211, 217, 218, 220, 221, 226, 240, 250, 255, 256, 260, 261, 280, 281, 282, 290, 300,
+        301, 302, 303, 304, 305, 306, 350, 351, 355, 360, 361, 362, 363, 364, 380, 381, 400, 401, 402, 403,
+        404, 405, 406, 407, 410, 412, 413, 420, 421, 422, 423, 425, 428, 430, 486, 493, 500, 501, 502, 503,
+        504, 510, 511, 512, 524, 540, 569, 575, 592, 593, 600, 603, 605, 665, 666, 672, 701, 702, 710, 808,
+        810, 811, 812, 813, 814, 815, 816, 817, 818, 819, 851, 852, 860, 861, 862, 863, 864, 865, 866, 867,
+        868, 869, 871, 876, 900, 906, 907, 908, 909, 910, 911, 912, 913, 914, 915, 916, 917, 918, 919, 928,
+        951, 993, 994, 995, 997, 999 };
+    return letter == 'M' && std::binary_search(std::begin(m_codes), std::end(m_codes), num);
+}
+
+// What the sequential pass needs to track positions
+struct MoveRecord {
+    enum Kind : uint8_t { Move, Absolute, Relative, SetPosition, Home };
+    uint32_t line;
+    Kind kind;
+    uint8_t axes;        // bit per X/Y/Z present
+    float v[3];
+};
+
+struct PreflightChunk {
+    long commands = 0, errors = 0, warnings = 0;
+    std::vector<PreflightIssue> issues;    // capped
+    std::vector<MoveRecord> moves;
+};
+
+void preflight_chunk(const GcodeIr& ir, size_t first, size_t last, const Overrides& ov, const MachineLimits& lim, PreflightChunk& out) {
+    long line = 0;
+    auto issue = [&](bool error, std::string what) {
+        (error ? out.errors : out.warnings)++;
+        if (out.issues.size() < 1000) out.issues.push_back({ line, error, std::move(what) });
+    };
+    IrReader in(ir, first, last);
+    CommandBatch b;
+    std::string text;
+    while (b.clear(), in.read(b, 1024)) {
+        for (size_t i = 0; i < b.size(); ++i) {
+            line = b.file_line[i];
+            out.commands++;
+            char letter = b.letter[i];
+            int num = b.number[i], sub = std::max<int>(b.sub[i], 0);
+            if (letter != 'G' && letter != 'M' && letter != 'T') {
+                // Kept as text by the IR: not a command, or one with stray words or repeated letters
+                text.clear();
+                b.append_text(i, text);
+                CommandBatch one;
+                one.add(text, line);
+                letter = one.letter[0];
+                if (letter == 'G' || letter == 'M' || letter == 'T') issue(true, "can't parse parameters of " + std::string(1, letter) + std::to_string(one.number[0]));
+                else issue(true, "not a G-code command: " + text.substr(0, 40));
+                continue;
+            }
+            if (!known_gcode(letter, num, sub))
+                issue(false, std::string("unknown command ") + letter + std::to_string(num) + (sub ? "." + std::to_string(sub) : ""));
+            if (takes_text(letter, num)) continue;
+
+            double val[26];
+            uint32_t has = 0;
+            bool bad = false;
+            for (size_t j = b.first[i]; j < b.first[i] + b.count[i]; ++j) {
+                if (b.p_dec[j] == CommandBatch::RAW) { bad = true; break; }
+                val[b.p_letter[j] - 'A'] = b.has_value(j) ? to_double(b.value(j)) : 0;
+                has |= 1u << (b.p_letter[j] - 'A');
+            }
+            if (bad) { issue(true, "can't parse parameters of " + std::string(1, letter) + std::to_string(num)); continue; }
+            auto present = [&](char c) { return (has >> (c - 'A')) & 1; };
+
+            if (present('F')) {
+                double f = val['F' - 'A'];
+                if (ov.feedrate_percent > 0) f = f * ov.feedrate_percent / 100.0;
+                if (f <= 0 && letter == 'G') issue(true, "feedrate F" + std::to_string(f) + " is not positive");
+                else if (f > lim.max_feedrate) issue(true, "feedrate " + std::to_string(int(f)) + " mm/min above the " + std::to_string(int(lim.max_feedrate)) + " limit");
+            }
+            if (letter == 'M' && (num == 104 || num == 109 || num == 140 || num == 190) && present('S')) {
+                bool bed = num == 140 || num == 190;
+                int forced = bed ? ov.bed_temp : ov.hotend_temp;
+                double t = forced >= 0 ? forced : val['S' - 'A'];
+                int limit = bed ? lim.max_bed : lim.max_hotend;
+                if (t < 0 || t > limit)
+                    issue(true, std::string(bed ? "bed" : "hotend") + " temperature " + std::to_string(int(t)) + "°C outside 0.." + std::to_string(limit));
+            }
+
+            MoveRecord m{ (uint32_t)line, MoveRecord::Move, 0, { 0, 0, 0 } };
+            for (int a = 0; a < 3; ++a)
+                if (present("XYZ"[a])) { m.axes |= 1 << a; m.v[a] = (float)val["XYZ"[a] - 'A']; }
+            if (letter == 'G') {
+                if (num <= 3 && m.axes) out.moves.push_back(m);
+                else if (num == 90) { m.kind = MoveRecord::Absolute; out.moves.push_back(m); }
+                else if (num == 91) { m.kind = MoveRecord::Relative; out.moves.push_back(m); }
+                else if (num == 92 && m.axes) { m.kind = MoveRecord::SetPosition; out.moves.push_back(m); }   // bare G92: ignored by Marlin 2
+                else if (num == 28) { m.kind = MoveRecord::Home; if (!m.axes) m.axes = 7; out.moves.push_back(m); }
+            }
+        }
+    }
+}
+
+PreflightReport preflight(const GcodeIr& ir, const Overrides& ov, const MachineLimits& lim) {
+    PreflightReport rep;
+    auto t0 = std::chrono::steady_clock::now();
+
+    // At least 16 segments (64k commands) per thread
+    size_t segs = ir.segments.size();
+    int n = std::max(1, std::min<int>(std::thread::hardware_concurrency(), int(segs / 16)));
+    std::vector<PreflightChunk> chunks(n);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n; ++i)
+        workers.emplace_back([&, i] { leave_realtime_worker(); preflight_chunk(ir, segs * i / n, segs * (i + 1) / n, ov, lim, chunks[i]); });
+    preflight_chunk(ir, 0, segs / n, ov, lim, chunks[0]);
+    for (auto& w : workers) w.join();
+
+    // Merge, then replay positions
+    double pos[3] = { 0, 0, 0 }, shift[3] = { 0, 0, 0 };   // shift: physical = logical + shift (G92)
+    bool known[3] = { false, false, false }, absolute = true;
+    // --z-offset as ZOffsetStage applies it: to absolute Z moves until a G92 Z
+    // takes the raised head as the file's own coordinates, again after G28 Z
+    double z_offset = to_double(ov.z_offset);
+    bool raised = false, absorbed = false;
+    std::vector<PreflightIssue> moves_issues;
+    for (auto& c : chunks) {
+        for (auto& is : c.issues) rep.issues.push_back(std::move(is));
+        for (const MoveRecord& m : c.moves) {
+            for (int a = 0; a < 3; ++a) {
+                if (!(m.axes >> a & 1)) continue;
+                switch (m.kind) {
+                    case MoveRecord::Move:
+                        if (absolute) {
+                            pos[a] = m.v[a] + shift[a] + (a == 2 && !absorbed ? z_offset : 0);
+                            known[a] = true;
+                            if (a == 2) raised = true;
+                        }
+                        else pos[a] += m.v[a];
+                        if (known[a] && (pos[a] < lim.min[a] - 0.001 || pos[a] > lim.max[a] + 0.001) && ++rep.errors <= 1000) {
+                            std::ostringstream o;
+                            o << "move to " << "XYZ"[a] << pos[a] << " outside 0.." << lim.max[a];
+                            moves_issues.push_back({ m.line, true, o.str() });
+                        }
+                        break;
+                    case MoveRecord::SetPosition:
+                        if (known[a]) shift[a] = pos[a] - m.v[a];
+                        if (a == 2) absorbed = raised;
+                        break;
+                    case MoveRecord::Home:
+                        pos[a] = lim.min[a]; shift[a] = 0; known[a] = true;
+                        if (a == 2) raised = absorbed = false;
+                        break;
+                    default: break;
+                }
+            }
+            if (m.kind == MoveRecord::Absolute) absolute = true;
+            if (m.kind == MoveRecord::Relative) absolute = false;
+        }
+        rep.errors += c.errors;
+        rep.warnings += c.warnings;
+        rep.commands += c.commands;
+    }
+    for (auto& is : moves_issues) rep.issues.push_back(std::move(is));
+    std::stable_sort(rep.issues.begin(), rep.issues.end(), [](const PreflightIssue& a, const PreflightIssue& b) { return a.line < b.line; });
+
+    rep.lines = ir.lines;
+    rep.threads = n;
+    rep.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    return rep;
+}
+
+// Prints the report; true if the file may be printed
+bool print_preflight(const std::string& file, const PreflightReport& rep) {
+    std::ostringstream ms;
+    ms << std::fixed << std::setprecision(1) << rep.ms;
+    std::cout << "Pre-flight " << file << ": " << rep.lines << " lines, " << rep.commands << " commands in "
+              << ms.str() << " ms on " << rep.threads << " thread(s) — "
+              << rep.errors << " errors, " << rep.warnings << " warnings\n";
+    int shown = 0;
+    for (const auto& is : rep.issues) {
+        if (shown++ == 20) { std::cout << "  ...\n"; break; }
+        std::cout << "  line " << is.line << ": " << (is.error ? "error: " : "warning: ") << is.what << "\n";
+    }
+    return rep.errors == 0;
+}
+
+// --rt: what the serial thread reads while streaming, in memory for good.
+// Freed IRs stay in the untrimmed heap, so this grows to the largest job.
+void lock_ir(const GcodeIr& ir) {
+    auto lock = [](const void* p, size_t n) { return n == 0 || mlock(p, n) == 0; };
+    if (!lock(ir.code.data(), ir.code.size()) || !lock(ir.segments.data(), ir.segments.size() * sizeof(IrSegment)) ||
+        !lock(ir.layers.data(), ir.layers.size() * sizeof(IrLayer)))
+        std::cerr << "mlock: " << strerror(errno) << " — job not locked in memory\n";
+}
+
+// Stream one file. quiet is for the between-job macro: no banner, no progress.
+JobResult stream_job(Session& s, const std::string& file, const Overrides& ov, bool quiet = false) {
+    GcodeIr ir;
+    if (!load_ir(file, ir)) { std::cerr << "Cannot open " << file << "\n"; return JobResult::NoFile; }
+    if (ov.preflight && !quiet && !print_preflight(file, preflight(ir, ov, ov.limits))) {
+        std::cerr << "Not printing " << file << ": pre-flight found errors\n";
+        return JobResult::Rejected;
+    }
+    if (s.rt.priority > 0) lock_ir(ir);
+
+    int total = (int)ir.commands;
+    IrReader in(ir);
+    StartRewrite start;
+    if (ov.fast_start > 0 && !quiet) {
+        start = rewrite_start(in, ov.fast_start, ov.stored_mesh);
+        total += int(start.lines.size()) - start.consumed;
+    }
+    s.total = total; s.sent = 0;
+    std::vector<LayerMark> marks;
+    double estimate = quiet ? 0 : estimate_seconds(ir, ov.limits, s.status ? &marks : nullptr);
+    if (s.status) { s.status->begin_job(file, std::move(marks), estimate); s.status->publish(s, 0); }
+
+    if (!sync_line_numbers(s, ov.debug)) { std::cerr << "\nTimeout!\n"; return JobResult::LinkLost; }
+    if (!quiet) std::cout << "Streaming " << file << " (" << total << " commands, " << ir.layers.size() << " layers, ≈ "
+                          << format_duration(estimate) << " of moves)\n\n";
+
+    Engine e(s, ov.window, ov.debug);
+    JobResult result = JobResult::LinkLost;
+    s.temp_log.start(SessionClock::now());
+    e.spawn(send_file(e, s, in, ov, quiet, total, start, result));
+    if (start.merged) e.spawn(watch_hotend(e, s, start, ov.hotend_temp >= 0 ? ov.hotend_temp : start.hot_target), true);
+    if (ov.temp_poll_s > 0 && !quiet) e.spawn(poll_temps(e, s, ov.temp_poll_s), true);
+    if (s.probe && !quiet) s.probe->reset();
+    s.jitter.enabled = ov.jitter_ms > 0 && !quiet;
+    s.jitter.threshold_ms = ov.jitter_ms;
+    s.jitter.start();
+    bool ok = e.run();
+    if (s.status) { s.status->state(StatusState::Idle); s.status->publish(s, 0); }
+    if (s.probe && !quiet) s.probe->report();
+    s.jitter.report();
+    if (!ov.temp_log.empty() && !quiet) {
+        if (s.temp_log.save(ov.temp_log))
+            std::cout << "Temperature log: " << s.temp_log.size() << " samples → " << ov.temp_log
+                      << (s.temp_log.dropped() ? " (oldest " + std::to_string(s.temp_log.dropped()) + " overwritten)" : "") << "\n";
+        else std::cerr << "Cannot write " << ov.temp_log << "\n";
+    }
+    return ok ? result : JobResult::LinkLost;
+}
+
+// G-code files in dir, by name, that haven't been printed yet this session
+std::vector<std::string> scan_queue_dir(const std::string& dir, const std::set<std::string>& done) {
+    std::vector<std::string> files;
+    std::error_code ec;
+    for (const auto& e : std::filesystem::directory_iterator(dir, ec)) {
+        if (!e.is_regular_file()) continue;
+        std::string ext = e.path().extension().string();
+        for (char& c : ext) c = std::tolower(c);
+        if (ext != ".gcode" && ext != ".gco" && ext != ".g" && ext != ".gir") continue;
+        if (!done.count(e.path().string())) files.push_back(e.path().string());
+    }
+    if (ec) std::cerr << "Cannot read queue directory " << dir << ": " << ec.message() << "\n";
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+// Writes Session's counters in node_exporter textfile format to path.tmp and
+// renames it over path, so the collector never reads a half-written file.
+class MetricsExporter {
+public:
+    MetricsExporter(const std::string& path, int interval_s, const std::string& port, Session& s)
+        : path(path), port(escape_label(port)), interval(std::max(1, interval_s)), s(s), t([this] { loop(); }) {}
+    ~MetricsExporter() {
+        { std::lock_guard<std::mutex> lock(m); stop = true; }
+        cv.notify_all();
+        t.join();
+    }
+
+private:
+    std::string path, port;   // port escaped for a label value
+    int interval;
+    Session& s;
+    std::mutex m;
+    std::condition_variable cv;
+    bool stop = false;
+    std::thread t;
+
+    // A TCP host name or device path goes between quotes: \\, \" and \n as
+    // the exposition format has it, or the collector drops the whole file
+    static std::string escape_label(const std::string& v) {
+        std::string out;
+        for (char c : v) {
+            if (c == '\\' || c == '"') out += '\\';
+            if (c == '\n') out += "\\n";
+            else out += c;
+        }
+        return out;
+    }
+
+    void loop() {
+        leave_realtime(s.rt);
+        std::unique_lock<std::mutex> lock(m);
+        do {
+            lock.unlock();
+            write_file();
+            lock.lock();
+        } while (!cv.wait_for(lock, std::chrono::seconds(interval), [this] { return stop; }));
+        lock.unlock();
+        write_file();   // final values
+    }
+
+    void write_file() {
+        const Metrics& mt = s.metrics;
+        std::string lbl = "{port=\"" + port + "\"}";
+        std::ostringstream o;
+        o << std::setprecision(15);   // sums and temperatures as read, not rounded to 6 digits
+        // Counters stay integers: "1234567", never "1.23457e+06"
+        auto metric = [&](const char* name, const char* type, const char* help, auto v) {
+            o << "# HELP marlin_streamer_" << name << " " << help << "\n"
+              << "# TYPE marlin_streamer_" << name << " " << type << "\n"
+              << "marlin_streamer_" << name << lbl << " " << v << "\n";
+        };
+        metric("commands_sent_total", "counter", "G-code commands sent", mt.commands.load());
+        metric("bytes_sent_total", "counter", "Bytes written to the printer", mt.bytes.load());
+        metric("resends_total", "counter", "Resend requests from the printer", s.link.resends.load());
+        metric("checksum_errors_total", "counter", "Checksum errors reported by the printer", s.link.checksum.load());
+        metric("timeouts_total", "counter", "Reads that timed out with commands in flight", s.link.timeouts.load());
+        metric("window_depth", "gauge", "Commands sent but not yet acked", mt.window_depth.load());
+        metric("baud", "gauge", "Current serial rate", mt.baud.load());
+        metric("job_commands_sent", "gauge", "Commands of the current job sent so far", s.sent.load());
+        metric("job_commands_total", "gauge", "Commands in the current job", s.total.load());
+        metric("job_progress_ratio", "gauge", "Fraction of the current job sent", s.total ? double(s.sent) / s.total : 0.0);
+
+        o << "# HELP marlin_streamer_temperature_celsius Last reported temperatures\n"
+          << "# TYPE marlin_streamer_temperature_celsius gauge\n";
+        auto temp = [&](const char* heater, const char* kind, double v) {
+            if (!std::isnan(v)) o << "marlin_streamer_temperature_celsius{port=\"" << port << "\",heater=\"" << heater << "\",kind=\"" << kind << "\"} " << v << "\n";
+        };
+        temp("hotend", "current", mt.hotend); temp("hotend", "target", mt.hotend_target);
+        temp("bed", "current", mt.bed);       temp("bed", "target", mt.bed_target);
+
+        o << "# HELP marlin_streamer_ack_latency_seconds Time from writing a command to its ok\n"
+          << "# TYPE marlin_streamer_ack_latency_seconds histogram\n";
+        long cum = 0;
+        for (int b = 0; b <= Metrics::NUM_BUCKETS; ++b) {
+            cum += mt.ack_buckets[b].load();
+            o << "marlin_streamer_ack_latency_seconds_bucket{port=\"" << port << "\",le=\"";
+            if (b < Metrics::NUM_BUCKETS) o << Metrics::BUCKET_LE_S[b]; else o << "+Inf";
+            o << "\"} " << cum << "\n";
+        }
+        o << "marlin_streamer_ack_latency_seconds_sum" << lbl << " " << mt.ack_sum_us.load() / 1e6 << "\n"
+          << "marlin_streamer_ack_latency_seconds_count" << lbl << " " << mt.ack_count.load() << "\n";
+
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::trunc);
+            if (!(f << o.str())) { std::cerr << "Cannot write " << tmp << "\n"; return; }
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) std::cerr << "Cannot rename " << tmp << ": " << strerror(errno) << "\n";
+    }
+};
+
+// ---- Daemon mode -----------------------------------------------------------
+// One resident process per printer keeps the port open and accepts work over a
+// Unix socket, one command per line, one reply line each:
+//   SUBMIT <path>   → OK <id>             queue a file
+//   STATUS          → OK <state> ...      idle|printing, progress, queue, temps
+//   CANCEL [id]     → OK | ERR ...        stop the running job, or drop a queued one
+//   PAUSE, RESUME   → OK | ERR ...        park the running job's head, and carry on
+//   SHUTDOWN        → OK                  cancel the running job, as CANCEL does, and exit
+// The serial side runs on the main thread exactly as a normal session does;
+// the control thread only touches the queue and Session's atomics.
+
+struct JobQueue {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::pair<int, std::string>> pending;
+    int next_id = 1;
+    int current_id = 0;
+    std::string current_file;
+    std::string last_temps;
+    bool online = true;
+    bool shutdown = false;
+    int completed = 0, failed = 0, cancelled = 0;
+};
+
+std::string handle_control(const std::string& req, JobQueue& q, Session& s) {
+    std::istringstream iss(req);
+    std::string verb, arg;
+    iss >> verb;
+    std::getline(iss, arg);
+    trim(arg);
+    for (char& c : verb) c = std::toupper(c);
+
+    std::lock_guard<std::mutex> lock(q.m);
+    if (verb == "SUBMIT") {
+        if (arg.empty()) return "ERR missing path";
+        if (access(arg.c_str(), R_OK) != 0) return "ERR cannot read " + arg;
+        int id = q.next_id++;
+        q.pending.emplace_back(id, arg);
+        q.cv.notify_all();
+        return "OK " + std::to_string(id);
+    }
+    if (verb == "STATUS") {
+        std::ostringstream o;
+        o << "OK " << (!q.online ? "offline" : !q.current_id ? "idle" : s.pause ? "paused" : "printing");
+        if (q.current_id) o << " job=" << q.current_id << " file=" << q.current_file << " progress=" << s.sent << "/" << s.total;
+        o << " queued=" << q.pending.size() << " completed=" << q.completed << " failed=" << q.failed << " cancelled=" << q.cancelled << " baud=" << s.metrics.baud;
+        if (!q.last_temps.empty()) o << " temps=" << q.last_temps;
+        return o.str();
+    }
+    if (verb == "CANCEL") {
+        int id = arg.empty() ? q.current_id : std::atoi(arg.c_str());
+        if (id && id == q.current_id) { s.cancel = true; return "OK"; }
+        for (auto it = q.pending.begin(); it != q.pending.end(); ++it)
+            if (it->first == id) { q.pending.erase(it); return "OK"; }
+        return "ERR no such job";
+    }
+    if (verb == "PAUSE" || verb == "RESUME") {
+        if (!q.current_id) return "ERR no job running";
+        s.pause = verb == "PAUSE";
+        return "OK";
+    }
+    if (verb == "SHUTDOWN") {
+        q.shutdown = true;
+        s.cancel = true;
+        q.cv.notify_all();
+        return "OK";
+    }
+    return "ERR unknown command";
+}
+
+void control_thread(int listen_fd, JobQueue& q, Session& s) {
+    leave_realtime(s.rt);
+    std::vector<struct pollfd> fds{ { listen_fd, POLLIN, 0 } };
+    std::vector<std::string> bufs{ "" };
+
+    while (true) {
+        { std::lock_guard<std::mutex> lock(q.m); if (q.shutdown) break; }
+        if (poll(fds.data(), fds.size(), 500) <= 0) continue;
+
+        if (fds[0].revents & POLLIN) {
+            int c = accept(listen_fd, nullptr, nullptr);
+            if (c >= 0) { fds.push_back({ c, POLLIN, 0 }); bufs.emplace_back(); }
+        }
+        for (size_t i = fds.size() - 1; i > 0; --i) {
+            if (!fds[i].revents) continue;
+            char buf[512];
+            ssize_t n = read(fds[i].fd, buf, sizeof buf);
+            bool drop = n <= 0;
+            if (n > 0) bufs[i].append(buf, n);
+            for (size_t nl; !drop && (nl = bufs[i].find('\n')) != std::string::npos; ) {
+                std::string req = bufs[i].substr(0, nl);
+                bufs[i].erase(0, nl + 1);
+                trim(req);
+                if (req.empty()) continue;
+                std::string reply = handle_control(req, q, s) + "\n";
+                if (send(fds[i].fd, reply.c_str(), reply.size(), MSG_NOSIGNAL) < 0) drop = true;
+            }
+            if (drop || bufs[i].size() > 4096) {
+                close(fds[i].fd);
+                fds.erase(fds.begin() + i);
+                bufs.erase(bufs.begin() + i);
+            }
+        }
+    }
+    for (size_t i = 1; i < fds.size(); ++i) close(fds[i].fd);
+}
+
+int open_control_socket(const std::string& path) {
+    struct sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) { std::cerr << "Socket path too long: " << path << "\n"; return -1; }
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) { std::cerr << "socket: " << strerror(errno) << "\n"; return -1; }
+    unlink(path.c_str());   // stale socket from a previous run
+    if (bind(fd, (struct sockaddr*)&addr, sizeof addr) != 0 || listen(fd, 8) != 0) {
+        std::cerr << "Cannot listen on " << path << ": " << strerror(errno) << "\n";
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// M105 while idle so a dead printer or unplugged cable shows up in STATUS
+// before anyone submits a job to it.
+bool idle_check(Session& s, JobQueue& q, bool debug) {
+    s.io->write("M105\n", 5);
+    for (std::string resp; !(resp = s.io->read_line(2000)).empty(); ) {
+        if (debug) std::cout << "<< " << resp << "\n";
+        if (resp.find("ok") == std::string::npos) continue;
+        std::lock_guard<std::mutex> lock(q.m);
+        size_t t = resp.find("T:");
+        q.last_temps = t == std::string::npos ? "" : resp.substr(t);
+        for (char& c : q.last_temps) if (c == ' ') c = ',';
+        q.online = true;
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(q.m);
+    q.online = false;
+    return false;
+}
+
+int run_daemon(Session& s, const std::string& sock_path, std::vector<std::string> files,
+               const std::string& between, int idle_poll_s, const Overrides& ov) {
+    int listen_fd = open_control_socket(sock_path);
+    if (listen_fd < 0) return 1;
+
+    JobQueue q;
+    for (auto& f : files) q.pending.emplace_back(q.next_id++, f);
+    std::thread ctl(control_thread, listen_fd, std::ref(q), std::ref(s));
+    std::cout << "Daemon listening on " << sock_path << "\n";
+
+    int jobs = 0;
+    while (true) {
+        int id;
+        std::string file;
+        {
+            std::unique_lock<std::mutex> lock(q.m);
+            q.cv.wait_for(lock, std::chrono::seconds(idle_poll_s), [&] { return q.shutdown || !q.pending.empty(); });
+            if (cancel_signalled) q.shutdown = true;   // Ctrl-C or SIGTERM: cancel the job, then stop
+            if (q.shutdown) break;
+            if (q.pending.empty()) { lock.unlock(); idle_check(s, q, ov.debug); continue; }
+            std::tie(id, file) = q.pending.front();
+            q.pending.pop_front();
+            // Before current_id goes up, so a CANCEL for this job can't be wiped out
+            s.cancel = false;
+            s.pause = false;
+            q.current_id = id;
+            q.current_file = file;
+        }
+
+        JobResult r = JobResult::Done;
+        if (jobs++ > 0 && !between.empty()) r = stream_job(s, between, ov, true);
+        if (r == JobResult::Done) {
+            std::cout << "\nJob " << id << ": ";
+            r = stream_job(s, file, ov);
+        }
+
+        std::lock_guard<std::mutex> lock(q.m);
+        (r == JobResult::Done ? q.completed : r == JobResult::Cancelled ? q.cancelled : q.failed)++;
+        q.current_id = 0;
+        q.current_file.clear();
+        if (r == JobResult::LinkLost) q.online = false;
+    }
+
+    ctl.join();
+    close(listen_fd);
+    unlink(sock_path.c_str());
+    std::cout << "\nDaemon stopped\n";
+    return 0;
+}
+
+// Tiny client for the control socket: --ctl=SOCK COMMAND [ARG]
+int control_client(const std::string& sock_path, int argc, char** argv, int first) {
+    std::string req;
+    for (int i = first; i < argc; ++i) {
+        std::string a = argv[i];
+        // Paths are resolved by the daemon, which may run in another directory
+        if (i == first + 1 && req == "SUBMIT") a = std::filesystem::absolute(a).string();
+        req += (req.empty() ? "" : " ") + a;
+    }
+    if (req.empty()) req = "STATUS";
+
+    struct sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, sock_path.c_str(), sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof addr) != 0) {
+        std::cerr << "Cannot connect to " << sock_path << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    req += "\n";
+    write(fd, req.c_str(), req.size());
+    std::string reply = read_line(fd, 5000);
+    close(fd);
+    std::cout << reply << "\n";
+    return reply.find("OK") == 0 ? 0 : 1;
+}
+
+// Reader for --shm: --shm-read NAME [seconds] prints the status once, or every
+// so many seconds until the streamer exits
+int shm_read(std::string name, double interval_s) {
+    if (name[0] != '/') name = "/" + name;
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    struct stat st{};
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t)offsetof(StatusSegment, data)) {
+        std::cerr << "No status segment " << name << (fd < 0 ? std::string(": ") + strerror(errno) : "") << "\n";
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) { std::cerr << "Cannot map " << name << ": " << strerror(errno) << "\n"; return 1; }
+    auto* seg = (const StatusSegment*)m;
+    if (seg->magic != StatusSegment::MAGIC || seg->version != StatusSegment::VERSION ||
+        seg->size < offsetof(StatusSegment, data) || seg->size > st.st_size) {
+        std::cerr << name << " is not a status segment this version knows\n";
+        return 1;
+    }
+
+    for (bool first = true; ; first = false) {
+        StatusData d;
+        if (!read_status(seg, d)) { std::cerr << "Status segment busy\n"; return 1; }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        double age = (ts.tv_sec * 1000000000LL + ts.tv_nsec - d.updated_ns) / 1e9;
+        int state = std::clamp(d.state, 0, 4);
+        CoutFormat keep;
+        std::cout << (first ? "" : "\n") << std::fixed << std::setprecision(1)
+                  << STATUS_STATE_NAMES[state] << (d.file[0] ? "  " : "") << d.file
+                  << "  (pid " << seg->pid << ", updated " << age << " s ago)\n";
+        if (d.state != int32_t(StatusState::Idle))
+            std::cout << "  " << d.sent << "/" << d.total << " commands (" << (d.total ? 100.0 * d.sent / d.total : 0.0)
+                      << "%), file line " << d.file_line << ", layer " << d.layer << "/" << d.layers << " at z " << d.z << "\n"
+                      << "  elapsed " << format_duration(d.elapsed_s)
+                      << (d.eta_s >= 0 ? ", ≈ " + format_duration(d.eta_s) + " left" : "") << "\n";
+        auto temp = [](double cur, double target) {
+            if (std::isnan(cur)) return std::string("?");
+            std::ostringstream o;
+            o << std::fixed << std::setprecision(1) << cur;
+            if (!std::isnan(target)) o << "/" << target;
+            return o.str() + "°C";
+        };
+        std::cout << "  hotend " << temp(d.hotend, d.hotend_target) << ", bed " << temp(d.bed, d.bed_target) << "\n"
+                  << "  " << d.window_depth << " in flight, next N" << d.marlin_line << ", " << d.baud << " baud, "
+                  << d.resends << " resends, " << d.timeouts << " timeouts\n" << std::flush;
+        if (interval_s <= 0) return 0;
+        usleep(useconds_t(interval_s * 1e6));
+        if (access(("/dev/shm" + name).c_str(), F_OK) != 0) { std::cout << "\nStreamer exited\n"; return 0; }
+    }
+}
+
+// ---- --selftest ------------------------------------------------------------------
+// What the cable and the USB-serial chip manage before any G-code is to blame.
+// At every rate get_baud_constant() knows — switched with M575 — it times ping
+// round trips one at a time (M105 and M118), then a burst of G4 P0, which
+// Marlin acks without moving anything, with BUFSIZE (4) or --window commands
+// in flight, and counts resends and timeouts. The printer ends up back on the rate it started at.
+
+struct SelftestRow {
+    int baud = 0;
+    std::string skipped;            // why the rate wasn't measured
+    std::vector<double> ping_ms;
+    int burst = 0;
+    double burst_s = 0;
+    long bytes = 0;
+    int resends = 0, timeouts = 0;
+};
+
+Task selftest_pass(Engine& e, Session& s, int pings, int burst, SelftestRow& row) {
+    for (int i = 0; i < pings; ++i) {
+        auto t0 = SessionClock::now();
+        long n = e.send(i % 2 ? "M118 selftest" : "M105");
+        if (!co_await e.ok_for(n)) co_return;
+        row.ping_ms.push_back(std::chrono::duration<double, std::milli>(SessionClock::now() - t0).count());
+    }
+    long bytes0 = s.metrics.bytes.load();
+    auto t0 = SessionClock::now();
+    for (int i = 0; i < burst; ++i) {
+        if (!co_await e.window_slot()) co_return;
+        e.send("G4 P0");
+    }
+    long last = e.last_seq();
+    if (!co_await e.ok_for(last)) co_return;
+    row.burst = burst;
+    row.burst_s = std::chrono::duration<double>(SessionClock::now() - t0).count();
+    row.bytes = s.metrics.bytes.load() - bytes0;
+}
+
+
+double percentile(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, size_t(p * (v.size() - 1) + 0.5))];
+}
+
+int run_selftest(Session& s, int window, bool debug) {
+    const int pings = 20, burst = 200, start = s.baud;
+    std::cout << "Link self-test: " << pings << " pings (M105/M118) and " << burst << " × G4 P0 with "
+              << window << " in flight, at each rate\n";
+    std::vector<SelftestRow> rows;
+    bool lost = false;
+    for (int baud : BAUD_RATES) {
+        SelftestRow row;
+        row.baud = baud;
+        if (lost) { row.skipped = "not tried — link lost"; rows.push_back(row); continue; }
+        if (baud != s.baud && !has_baud(s.transport)) {
+            row.skipped = std::string("not tried — no baud rate over ") + TRANSPORT_NAMES[int(s.transport)];
+            rows.push_back(row);
+            continue;
+        }
+        if (baud != s.baud) {
+            // The last switch can leave an ok behind — M575's own besides the check's
+            while (!s.io->read_line(100).empty()) {}
+            sync_line_numbers(s, debug);   // M575 goes out as a numbered line
+            BaudChange r = renegotiate_baud(*s.io, s.baud, baud, s.line_num, debug);
+            if (r != BaudChange::Switched) {
+                if (r == BaudChange::Refused) row.skipped = "refused (no M575, or not a rate this firmware has)";
+                else {
+                    row.skipped = "no answer after M575";
+                    if (r == BaudChange::Lost) { lost = true; row.skipped += ", printer lost"; }
+                }
+                rows.push_back(row);
+                continue;
+            }
+        }
+        if (!sync_line_numbers(s, debug)) { row.skipped = "no answer to M110"; rows.push_back(row); continue; }
+
+        int resends0 = s.link.resends, timeouts0 = s.link.timeouts;
+        Engine e(s, window, debug);
+        e.spawn(selftest_pass(e, s, pings, burst, row));
+        if (!e.run() || !row.burst) row.skipped = "link failed mid-test";
+        row.resends = s.link.resends - resends0;
+        row.timeouts = s.link.timeouts - timeouts0;
+        rows.push_back(row);
+        std::cout << "  " << baud << " baud done\n";
+    }
+    if (!lost && s.baud != start) renegotiate_baud(*s.io, s.baud, start, s.line_num, debug);
+
+    CoutFormat keep;
+    std::cout << "\n    baud   ping ms min / med / p95   cmds/s    KB/s  line use  resends  timeouts\n"
+              << std::fixed;
+    const SelftestRow* best = nullptr;
+    double best_rate = 0;
+    for (const auto& r : rows) {
+        std::cout << std::setw(8) << r.baud << "   ";
+        if (!r.skipped.empty()) { std::cout << r.skipped << "\n"; continue; }
+        double rate = r.burst / r.burst_s, bps = r.bytes / r.burst_s;
+        std::cout << std::setprecision(1) << std::setw(7) << percentile(r.ping_ms, 0) << " / " << std::setw(5)
+                  << percentile(r.ping_ms, 0.5) << " / " << std::setw(5) << percentile(r.ping_ms, 0.95)
+                  << std::setprecision(0) << std::setw(9) << rate << std::setprecision(1) << std::setw(8) << bps / 1e3
+                  << std::setprecision(0) << std::setw(9) << 100 * bps * 10 / r.baud << "%"
+                  << std::setprecision(1) << std::setw(8) << 100.0 * r.resends / (pings + burst) << "%"
+                  << std::setw(10) << r.timeouts << "\n";
+        if (r.resends == 0 && r.timeouts == 0 && rate > best_rate) { best = &r; best_rate = rate; }
+    }
+    std::cout << "\nline use: burst bytes against what 8N1 at that rate can carry\n";
+    if (best) std::cout << "Best: " << best->baud << " baud — " << std::lround(best_rate) << " commands/s without a resend\n";
+    else std::cout << "No rate ran without resends or timeouts\n";
+    return best ? 0 : 1;
+}
+
+// ---- Simulated printer -----------------------------------------------------------
+// "sim" as the device runs a model of an Ender 3's Marlin on a pty, in a child
+// process, so window sizes, arc fitting and transforms can be benchmarked
+// against a printer that is slow the way the real one is. Lines take their
+// wire time at the baud rate. BUFSIZE commands fit in the command queue and the
+// rest wait in the 128-byte RX buffer. A move is acked only once it is in the
+// planner, which holds BLOCK_BUFFER_SIZE blocks. G2/G3 go in as 1 mm segments.
+// Blocks run as trapezoids with look-ahead: junction deviation at the
+// corners, and the last queued block plans to a stop. M410 empties the
+// planner when it arrives, and M108 ends an M109/M190 wait, as
+// EMERGENCY_PARSER does. Heaters are first-order
+// lags from room temperature; M109/M190 wait for TEMP_WINDOW and then the
+// residency time with a temperature line every second, and M155 turns on
+// auto-reports. G4, M400 and G28 wait for the planner to empty, with "busy:
+// processing" every 2 s as HOST_KEEPALIVE_FEATURE sends it. When the host closes the
+// port it reports how often the planner ran empty mid-print and for how long —
+// the stutter a host that can't keep up causes. With --fast-clock the printer
+// runs in-process instead, on the streamer's virtual clock (SimIo).
+
+struct SimConfig {
+    int bufsize = 4;                  // BUFSIZE
+    int blocks = 16;                  // BLOCK_BUFFER_SIZE
+    int rx_buffer = 128;              // RX_BUFFER_SIZE
+    double accel = 500;               // DEFAULT_ACCELERATION, mm/s²
+    double max_accel[4] = { 500, 500, 100, 5000 };    // DEFAULT_MAX_ACCELERATION
+    double max_speed[4] = { 500, 500, 5, 25 };        // DEFAULT_MAX_FEEDRATE, mm/s
+    double junction_deviation = 0.013;                // JUNCTION_DEVIATION_MM
+    double arc_segment = 1;                           // MM_PER_ARC_SEGMENT
+    double heat_tau[2] = { 20, 35 };                  // hotend, bed: time constants, s
+};
+
+class SimPrinter {
+public:
+    using Clock = SessionClock;
+
+    SimPrinter(int fd, int baud, const SimConfig& cfg) : fd(fd), byte_s(10.0 / baud), cfg(cfg) {}
+
+    void run() {
+        char buf[4096];
+        bool connected = false;
+        started = Clock::now();
+        while (true) {
+            advance(Clock::now());
+            if (!delivered.empty()) { ::write(fd, delivered.data(), delivered.size()); delivered.clear(); }
+            auto wake = next_event();
+            int ms = wake == Clock::time_point::max() ? 1000
+                   : (int)std::max<long long>(0, std::chrono::duration_cast<std::chrono::microseconds>(wake - Clock::now()).count() / 1000);
+            struct pollfd pfd{ fd, POLLIN, 0 };
+            int r = poll(&pfd, 1, ms);
+            if (r >= 0 && !(pfd.revents & (POLLHUP | POLLERR))) connected = true;   // opened, if not yet written to
+            if (r > 0 && (pfd.revents & POLLIN)) {
+                ssize_t n = read(fd, buf, sizeof buf);
+                if (n > 0) { connected = true; receive(buf, n, Clock::now()); continue; }
+            }
+            if (r > 0 && (pfd.revents & (POLLHUP | POLLERR))) {
+                if (connected) break;     // the host closed the port
+                usleep(10000);            // not opened yet
+            }
+        }
+        report();
+    }
+
+    // Runs every event up to t in order, so a jump of the virtual clock
+    // plays out the same as real time passing
+    void advance(Clock::time_point t) {
+        if (started == Clock::time_point()) started = t;
+        for (auto e = next_event(); e <= t; e = next_event()) step(std::max(e, at));
+        step(std::max(t, at));
+    }
+
+    Clock::time_point next_event() const {
+        auto t = Clock::time_point::max();
+        if (!out.empty()) t = std::min(t, out.front().first);
+        if (running) t = std::min(t, block_end);
+        if ((int)queue.size() < cfg.bufsize && !serial.empty()) t = std::min(t, serial.front().arrives);
+        for (const auto& p : serial)       // lines landing in a full RX buffer, for its peak
+            if (p.arrives > at) { t = std::min(t, p.arrives); break; }
+        if (!queue.empty() && busy_until > at) t = std::min(t, busy_until);
+        if (!queue.empty() && head_parsed && heat_wait < 0) t = std::min(t, keepalive);
+        if (heat_wait >= 0 || auto_report_s > 0) t = std::min(t, next_report);
+        return t;
+    }
+
+    void receive(const char* p, size_t n, Clock::time_point now) {
+        for (size_t i = 0; i < n; ++i) {
+            rx_wire = std::max(rx_wire, now) + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(byte_s));
+            if (p[i] != '\n') { if (p[i] != '\r') rx += p[i]; continue; }
+            bool emergency = rx.find("M410") != std::string::npos || rx.find("M108") != std::string::npos;   // EMERGENCY_PARSER
+            serial.push_back({ rx_wire, std::move(rx), emergency });
+            rx.clear();
+        }
+    }
+
+    std::string delivered;            // replies that have come off the wire, for the host to read
+
+    void report() {
+        double wall = std::chrono::duration<double>(at - started).count();
+        CoutFormat keep;
+        std::cout << std::fixed << std::setprecision(1)
+                  << "\nSimulated printer (BUFSIZE " << cfg.bufsize << ", " << cfg.blocks << " planner blocks): "
+                  << commands << " commands, " << moves << " planner blocks, " << motion_s << " s of motion in "
+                  << wall << " s\n"
+                  << "  planner ran empty mid-print " << starve_events << " times, " << starved_s << " s in all; "
+                  << stops << " blocks planned to a stop for want of a next one\n"
+                  << "  average planner depth " << (wall > 0 ? depth_sum / wall : 0) << " blocks; RX buffer peak "
+                  << rx_peak << " bytes of " << cfg.rx_buffer << (overflows ? " — OVERFLOWED " + std::to_string(overflows) + " times" : "")
+                  << "; " << resends << " resends asked"
+                  << (quick_stops ? "; " + std::to_string(quick_stops) + " quick stop(s)" : "")
+                  << (heat_breaks ? "; " + std::to_string(heat_breaks) + " heat wait(s) broken by M108" : "") << "\n" << std::flush;
+    }
+
+private:
+    struct Block {
+        double length, nominal, accel, max_entry, entry = 0;
+        double unit[3];
+    };
+    struct Pending { Clock::time_point arrives; std::string line; bool emergency = false; };
+
+    int fd;
+    double byte_s;                    // wire time per byte: 8N1
+    SimConfig cfg;
+
+    // Serial
+    std::string rx;
+    Clock::time_point rx_wire, tx_wire;
+    std::deque<Pending> serial;       // complete lines, on the wire until arrives
+    long rx_waiting = 0;
+    std::deque<std::pair<Clock::time_point, std::string>> out;
+    long last_line = 0;
+
+    // Command queue and the command being executed
+    std::deque<std::string> queue;
+    CommandBatch cmd;
+    std::vector<std::array<double, 4>> segments;   // moves of the head command still to plan
+    size_t next_segment = 0;
+    bool head_parsed = false;
+    Clock::time_point busy_until;     // G4 / G28 in progress
+    Clock::time_point keepalive;      // next "busy: processing" while the head command runs
+    HeadState head;
+    double planned[4] = { 0, 0, 0, 0 };
+
+    // Heaters: hotend, bed
+    static constexpr double AMBIENT = 25;
+    struct Heater { double temp = AMBIENT, target = 0; };
+    Heater heaters[2];
+    Clock::time_point heated_at;      // heaters[] are as of this time
+    int heat_wait = -1;               // M109 / M190 running: which heater
+    int auto_report_s = 0;            // M155 S
+    Clock::time_point next_report;    // the next temperature line, while waiting or auto-reporting
+
+    // Planner: front() is the block executing while running
+    std::deque<Block> planner;
+    bool running = false;
+    Clock::time_point block_end;
+    double exec_exit = 0;
+
+    Clock::time_point at;             // how far the model has run
+
+    // Statistics
+    Clock::time_point started, last_move_end, starved_since, depth_at;
+    bool starved = false, moved = false;
+    long commands = 0, moves = 0, stops = 0, starve_events = 0, resends = 0, rx_peak = 0, overflows = 0, quick_stops = 0, heat_breaks = 0;
+    double starved_s = 0, motion_s = 0, depth_sum = 0;
+
+    void send(const std::string& s, Clock::time_point now) {
+        tx_wire = std::max(tx_wire, now) + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s.size() * byte_s));
+        out.push_back({ tx_wire, s });
+    }
+
+    // Marlin's framing: N<line> ... *<checksum>, M110 to set the number
+    bool unframe(std::string& line, Clock::time_point now) {
+        if (line.empty() || line[0] != 'N') return !line.empty();
+        size_t star = line.rfind('*');
+        long n = std::atol(line.c_str() + 1);
+        unsigned char cs = 0;
+        for (size_t i = 0; i < std::min(star, line.size()); ++i) cs ^= (unsigned char)line[i];
+        size_t sp = line.find(' ');
+        std::string body = sp == std::string::npos ? "" : line.substr(sp + 1, star == std::string::npos ? std::string::npos : star - sp - 1);
+        bool m110 = body.rfind("M110", 0) == 0;
+        if (star == std::string::npos || std::atoi(line.c_str() + star + 1) != cs) {
+            send("Error:checksum mismatch, Last Line: " + std::to_string(last_line) + "\n", now);
+        } else if (n != last_line + 1 && !m110) {
+            send("Error:Line Number is not Last Line Number+1, Last Line: " + std::to_string(last_line) + "\n", now);
+        } else {
+            last_line = n;
+            line = body;
+            return true;
+        }
+        resends++;
+        send("Resend: " + std::to_string(last_line + 1) + "\nok\n", now);
+        return false;
+    }
+
+    void step(Clock::time_point now) {
+        at = now;
+        update_heaters(now);
+        for (bool progress = true; progress; ) {
+            progress = false;
+            while (!out.empty() && out.front().first <= now) {
+                delivered += out.front().second;
+                out.pop_front();
+            }
+            // Block finished: the next one starts where it ended
+            if (running && block_end <= now) {
+                account_depth(block_end);
+                last_move_end = block_end;
+                planner.pop_front();
+                running = false;
+                start_block(last_move_end);
+                progress = true;
+            }
+            // The emergency parser sees M410 and M108 as they come in, queue full or not
+            for (auto& p : serial) {
+                if (p.arrives > now) break;
+                if (!p.emergency) continue;
+                if (p.line.find("M410") != std::string::npos) quick_stop(now);
+                else if (heat_wait >= 0) { busy_until = now; heat_breaks++; }   // M108: wait_for_heatup = false
+                p.emergency = false;
+                progress = true;
+            }
+            // Serial → command queue
+            while ((int)queue.size() < cfg.bufsize && !serial.empty() && serial.front().arrives <= now) {
+                std::string line = std::move(serial.front().line);
+                serial.pop_front();
+                if (unframe(line, now)) queue.push_back(std::move(line));
+                progress = true;
+            }
+            if (execute(now)) progress = true;
+        }
+        if (!queue.empty() && head_parsed && heat_wait < 0 && keepalive <= now) {
+            send("echo:busy: processing\n", now);
+            keepalive = now + std::chrono::seconds(2);
+        }
+        if ((heat_wait >= 0 || auto_report_s > 0) && next_report <= now) {
+            std::string line = " " + temp_line();
+            if (heat_wait >= 0) {
+                double left = std::chrono::duration<double>(busy_until - now).count();
+                line += left <= TEMP_RESIDENCY_S ? " W:" + std::to_string((int)std::ceil(left)) : " W:?";
+            }
+            send(line + "\n", now);
+            next_report = now + std::chrono::seconds(heat_wait >= 0 ? 1 : auto_report_s);
+        }
+
+        // What has come in over the wire and waits for a queue slot
+        long waiting = 0;
+        for (const auto& p : serial) {
+            if (p.arrives > now) break;
+            waiting += (long)p.line.size() + 1;
+        }
+        if (waiting > cfg.rx_buffer && rx_waiting <= cfg.rx_buffer) overflows++;
+        rx_waiting = waiting;
+        rx_peak = std::max(rx_peak, waiting);
+    }
+
+    // Runs the head command as far as it can go now; true if anything changed
+    bool execute(Clock::time_point now) {
+        if (queue.empty() || busy_until > now) return false;
+        if (!head_parsed) { parse_head(); head_parsed = true; keepalive = now + std::chrono::seconds(2); }
+
+        // Moves: one planner block per segment, waiting for room
+        while (next_segment < segments.size() && !std::isnan(segments[next_segment][0])) {
+            if ((int)planner.size() >= cfg.blocks) return false;
+            add_block(segments[next_segment++], now);
+        }
+        // Synchronizing commands: the planner empties first, then the wait.
+        // Heat waits (third value 1) let the planner run on.
+        if (next_segment < segments.size()) {
+            bool sync = segments[next_segment][2] == 0;
+            if (sync && !planner.empty()) return false;
+            if (sync) starved = false;    // an intended stop, not starvation
+            double s = segments[next_segment++][1];
+            busy_until = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s));
+            if (s > 0) return true;
+        }
+
+        // Done: ok, and the queue slot is free
+        commands++;
+        std::string reply = "ok\n";
+        if (cmd.letter[0] == 'M' && cmd.number[0] == 105) reply = "ok " + temp_line() + "\n";
+        send(reply, now);
+        queue.pop_front();
+        head_parsed = false;
+        heat_wait = -1;
+        return true;
+    }
+
+    // What the head command turns into: planner moves, or a wait once the planner is empty (NAN X)
+    void parse_head() {
+        cmd.clear();
+        cmd.add(queue.front(), 0);
+        segments.clear();
+        next_segment = 0;
+        char l = cmd.letter[0];
+        int num = cmd.number[0];
+        double from[4];
+        if (head.apply(cmd, 0, from)) { plan_move(from, num); return; }
+        std::copy(head.pos, head.pos + 4, planned);   // G92, G28: new coordinates, no motion
+
+        double wait = -1;
+        if (l == 'G' && num == 28)   // to the endstops at HOMING_FEEDRATE, then the bump
+            wait = std::fabs(from[0]) / 50 + std::fabs(from[1]) / 50 + std::fabs(from[2]) / 4 + 2;
+        else if (l == 'G' && num == 4) {
+            wait = 0;
+            for (size_t j = cmd.first[0]; j < cmd.first[0] + cmd.count[0]; ++j) {
+                if (!cmd.has_value(j)) continue;
+                if (cmd.p_letter[j] == 'P') wait = to_double(cmd.value(j)) / 1000;
+                if (cmd.p_letter[j] == 'S') wait = to_double(cmd.value(j));
+            }
+        }
+        else if (l == 'M' && num == 400) wait = 0;
+        else if (l == 'M' && num == 110) {   // numbered or not, N is the line just sent
+            for (size_t j = cmd.first[0]; j < cmd.first[0] + cmd.count[0]; ++j)
+                if (cmd.p_letter[j] == 'N' && cmd.has_value(j)) last_line = (long)to_double(cmd.value(j));
+        }
+        else if (l == 'M' && (num == 104 || num == 109 || num == 140 || num == 190)) {
+            int h = num == 140 || num == 190;
+            double v = -1;
+            for (size_t j = cmd.first[0]; j < cmd.first[0] + cmd.count[0]; ++j)
+                if ((cmd.p_letter[j] == 'S' || cmd.p_letter[j] == 'R') && cmd.has_value(j)) v = to_double(cmd.value(j));
+            if (v >= 0) heaters[h].target = v;
+            if (num == 109 || num == 190) {
+                // S waits only for heating; from inside the window, just the residency
+                double t = heaters[h].temp, goal = std::max(heaters[h].target, AMBIENT), heat = 0;
+                if (t <= heaters[h].target) {
+                    if (goal - t > TEMP_WINDOW) heat = cfg.heat_tau[h] * std::log((goal - t) / TEMP_WINDOW);
+                    segments.push_back({ NAN, heat + TEMP_RESIDENCY_S, 1, 0 });
+                    heat_wait = h;
+                    next_report = at + std::chrono::seconds(1);
+                }
+            }
+        }
+        else if (l == 'M' && num == 155) {
+            auto_report_s = 0;
+            for (size_t j = cmd.first[0]; j < cmd.first[0] + cmd.count[0]; ++j)
+                if (cmd.p_letter[j] == 'S' && cmd.has_value(j)) auto_report_s = (int)to_double(cmd.value(j));
+            next_report = at + std::chrono::seconds(auto_report_s);
+        }
+        if (wait >= 0) segments.push_back({ NAN, wait, 0, 0 });
+    }
+
+    // Each heater closes on its target (or falls to room temperature) exponentially
+    void update_heaters(Clock::time_point now) {
+        double dt = heated_at == Clock::time_point() ? 0 : std::chrono::duration<double>(now - heated_at).count();
+        heated_at = now;
+        for (int h = 0; h < 2; ++h) {
+            double goal = std::max(heaters[h].target, AMBIENT);
+            heaters[h].temp = goal + (heaters[h].temp - goal) * std::exp(-dt / cfg.heat_tau[h]);
+        }
+    }
+
+    std::string temp_line() const {
+        char buf[96];
+        snprintf(buf, sizeof buf, "T:%.2f /%.2f B:%.2f /%.2f @:0 B@:0",
+                 heaters[0].temp, heaters[0].target, heaters[1].temp, heaters[1].target);
+        return buf;
+    }
+
+    // Target positions of the blocks a move turns into
+    void plan_move(const double from[4], int num) {
+        const double* to = head.pos;
+        bool arc = num == 2 || num == 3;
+        double ci = 0, cj = 0;
+        for (size_t j = cmd.first[0]; j < cmd.first[0] + cmd.count[0] && arc; ++j) {
+            if (cmd.p_letter[j] == 'I' && cmd.has_value(j)) ci = to_double(cmd.value(j));
+            if (cmd.p_letter[j] == 'J' && cmd.has_value(j)) cj = to_double(cmd.value(j));
+        }
+        if (!arc || (ci == 0 && cj == 0)) { segments.push_back({ to[0], to[1], to[2], to[3] }); return; }
+        double cx = from[0] + ci, cy = from[1] + cj, r = std::hypot(ci, cj);
+        double a0 = std::atan2(from[1] - cy, from[0] - cx);
+        double sweep = std::atan2(to[1] - cy, to[0] - cx) - a0;
+        if (num == 2 && sweep >= 0) sweep -= 2 * M_PI;
+        if (num == 3 && sweep <= 0) sweep += 2 * M_PI;
+        int n = std::max(1, int(std::fabs(sweep) * r / cfg.arc_segment));
+        for (int k = 1; k < n; ++k) {
+            double f = double(k) / n, a = a0 + sweep * f;
+            segments.push_back({ cx + r * std::cos(a), cy + r * std::sin(a), from[2] + (to[2] - from[2]) * f, from[3] + (to[3] - from[3]) * f });
+        }
+        segments.push_back({ to[0], to[1], to[2], to[3] });
+    }
+
+    void add_block(const std::array<double, 4>& target, Clock::time_point now) {
+        double d[4];
+        for (int a = 0; a < 4; ++a) { d[a] = target[a] - planned[a]; planned[a] = target[a]; }
+        double xyz = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        double len = xyz > 0 ? xyz : std::fabs(d[3]);
+        if (len < 1e-6) return;
+        Block b;
+        b.length = len;
+        b.nominal = head.feed / 60;
+        b.accel = cfg.accel;
+        for (int a = 0; a < 4; ++a) {
+            if (d[a] == 0) continue;
+            b.nominal = std::min(b.nominal, cfg.max_speed[a] * len / std::fabs(d[a]));
+            b.accel = std::min(b.accel, cfg.max_accel[a] * len / std::fabs(d[a]));
+        }
+        for (int a = 0; a < 3; ++a) b.unit[a] = xyz > 0 ? d[a] / xyz : 0;
+
+        // Junction deviation against the block before, if there is one still queued
+        b.max_entry = 0;
+        if (!planner.empty() && xyz > 0) {
+            const Block& p = planner.back();
+            double cos_theta = -(p.unit[0] * b.unit[0] + p.unit[1] * b.unit[1] + p.unit[2] * b.unit[2]);
+            double v = std::min(p.nominal, b.nominal);
+            if (cos_theta > -0.999999) {
+                double sin_half = std::sqrt(0.5 * (1 - cos_theta));
+                v = std::min(v, std::sqrt(b.accel * cfg.junction_deviation * sin_half / std::max(1e-9, 1 - sin_half)));
+            }
+            b.max_entry = v;
+        }
+        account_depth(now);
+        planner.push_back(b);
+        moves++;
+        replan();
+        if (starved) {
+            starve_events++;
+            starved_s += std::chrono::duration<double>(now - starved_since).count();
+            starved = false;
+        }
+        if (!running) start_block(now);
+    }
+
+    // Backward from a stop after the last block, forward from the running block's exit
+    void replan() {
+        size_t first = running ? 1 : 0;
+        double next = 0;
+        for (size_t i = planner.size(); i-- > first; ) {
+            Block& b = planner[i];
+            b.entry = std::min(b.max_entry, std::sqrt(next * next + 2 * b.accel * b.length));
+            next = b.entry;
+        }
+        double prev = running ? exec_exit : 0;
+        for (size_t i = first; i < planner.size(); ++i) {
+            Block& b = planner[i];
+            b.entry = std::min(b.entry, prev);
+            prev = std::min(b.nominal, std::sqrt(b.entry * b.entry + 2 * b.accel * b.length));
+        }
+    }
+
+    void start_block(Clock::time_point at) {
+        if (planner.empty()) {
+            if (moved) { starved = true; starved_since = at; }
+            return;
+        }
+        Block& b = planner.front();
+        double v1 = planner.size() > 1 ? planner[1].entry : 0;
+        if (planner.size() == 1) stops++;
+        double v0 = b.entry, vmax = b.nominal, a = b.accel, L = b.length;
+        double da = (vmax * vmax - v0 * v0) / (2 * a), dd = (vmax * vmax - v1 * v1) / (2 * a), t;
+        if (da + dd > L) {
+            double vp = std::sqrt(std::max(0.0, (2 * a * L + v0 * v0 + v1 * v1) / 2));
+            t = (vp - v0) / a + (vp - v1) / a;
+        } else t = (vmax - v0) / a + (vmax - v1) / a + (L - da - dd) / vmax;
+        t = std::max(t, 0.0);
+        motion_s += t;
+        exec_exit = v1;
+        running = true;
+        moved = true;
+        block_end = at + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(t));
+    }
+
+    // M410: the planner is emptied, and the head command plans nothing more
+    void quick_stop(Clock::time_point now) {
+        account_depth(now);
+        if (running) motion_s -= std::chrono::duration<double>(block_end - now).count();
+        planner.clear();
+        running = false;
+        starved = false;
+        while (next_segment < segments.size() && !std::isnan(segments[next_segment][0])) next_segment++;
+        quick_stops++;
+    }
+
+    void account_depth(Clock::time_point now) {
+        if (depth_at != Clock::time_point()) depth_sum += std::chrono::duration<double>(now - depth_at).count() * planner.size();
+        depth_at = now;
+    }
+};
+
+// "sim" as the device: a SimPrinter on a new pty in a child process. dev
+// becomes the pty's path; the pid is for waitpid() once the port is closed.
+pid_t start_simulator(std::string& dev, int baud, const SimConfig& cfg) {
+    int m = posix_openpt(O_RDWR | O_NOCTTY);
+    if (m < 0 || grantpt(m) != 0 || unlockpt(m) != 0) { std::cerr << "posix_openpt: " << strerror(errno) << "\n"; return -1; }
+    dev = ptsname(m);
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);   // don't outlive a streamer that never opened the port
+        for (int sig : { SIGUSR1, SIGUSR2, SIGTSTP }) signal(sig, SIG_IGN);   // pause signals are for the streamer
+        SimPrinter(m, baud, cfg).run();
+        _exit(0);
+    }
+    close(m);
+    return pid;
+}
+
+// --fast-clock: the SimPrinter in-process on a VirtualClock. A read that would
+// wait moves the clock on to the printer's next event instead of sleeping.
+struct SimIo : SerialIo {
+    SimPrinter& sim;
+    VirtualClock& clock;
+    SimIo(SimPrinter& p, VirtualClock& c) : sim(p), clock(c) {}
+
+    void write(const char* data, size_t len) override {
+        io_syscalls++;
+        sim.advance(clock.now());
+        sim.receive(data, len, clock.now());
+    }
+    void discard_input() override { sim.delivered.clear(); }
+
+    std::string read_line(int timeout_ms = 10000) override {
+        auto deadline = clock.now() + std::chrono::milliseconds(timeout_ms);
+        while (true) {
+            sim.advance(clock.now());
+            size_t nl = sim.delivered.find('\n');
+            if (nl != std::string::npos) {
+                std::string s = sim.delivered.substr(0, nl);
+                sim.delivered.erase(0, nl + 1);
+                return s;
+            }
+            if (clock.now() >= deadline) return "";
+            clock.advance_to(std::min(sim.next_event(), deadline));
+        }
+    }
+};
+
+// ---- --bench-io ----------------------------------------------------------------
+// Syscalls and host CPU per 1000 commands for each backend, against 1, 8 and 32
+// simulated printers on ptys — or, for tcp, on loopback connections. A forked
+// child answers every line with "ok" so its work doesn't count towards ours.
+
+void run_ok_responder(const std::vector<int>& masters) {
+    std::vector<struct pollfd> pfds;
+    for (int m : masters) pfds.push_back({ m, POLLIN, 0 });
+    char buf[4096];
+    std::string oks;
+    for (size_t open_fds = masters.size(); open_fds > 0; ) {
+        if (poll(pfds.data(), pfds.size(), -1) < 0 && errno != EINTR) break;
+        for (auto& p : pfds) {
+            if (p.fd < 0 || !p.revents) continue;
+            ssize_t n = read(p.fd, buf, sizeof buf);
+            if (n <= 0) { close(p.fd); p.fd = -1; open_fds--; continue; }
+            oks.clear();
+            for (ssize_t i = 0; i < n; ++i) if (buf[i] == '\n') oks += "ok\n";
+            if (!oks.empty()) ::write(p.fd, oks.data(), oks.size());
+        }
+    }
+}
+
+struct BenchResult { double syscalls_per_1k = 0, cpu_ms_per_1k = 0, wall_ms = 0; bool ok = false; };
+
+// Loopback pairs in place of ptys: masters the responder's ends, slaves ours
+bool tcp_pairs(int printers, std::vector<int>& masters, std::vector<int>& slaves) {
+    int ls = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in a{};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof a;
+    if (ls < 0 || bind(ls, (struct sockaddr*)&a, sizeof a) != 0 || listen(ls, printers) != 0 ||
+        getsockname(ls, (struct sockaddr*)&a, &len) != 0) {
+        std::cerr << "Cannot listen on loopback: " << strerror(errno) << "\n";
+        if (ls >= 0) close(ls);
+        return false;
+    }
+    std::string addr = "127.0.0.1:" + std::to_string(ntohs(a.sin_port));
+    for (int i = 0; i < printers; ++i) {
+        int c = connect_tcp(addr), m = c < 0 ? -1 : accept(ls, nullptr, nullptr);
+        if (m < 0) { close(ls); return false; }
+        masters.push_back(m);
+        slaves.push_back(c);
+    }
+    close(ls);
+    return true;
+}
+
+BenchResult bench_backend(const std::string& backend, int printers, int commands) {
+    BenchResult res;
+    bool uring = backend == "io_uring", tcp = backend == "tcp";
+    std::vector<int> masters, slaves;
+    if (tcp && !tcp_pairs(printers, masters, slaves)) return res;
+    for (int i = 0; i < printers && !tcp; ++i) {
+        int m = posix_openpt(O_RDWR | O_NOCTTY);
+        if (m < 0 || grantpt(m) != 0 || unlockpt(m) != 0) { std::cerr << "posix_openpt: " << strerror(errno) << "\n"; return res; }
+        int sl = open(ptsname(m), O_RDWR | O_NOCTTY);
+        if (sl < 0) { std::cerr << "Cannot open " << ptsname(m) << "\n"; return res; }
+        set_serial(sl, 115200);
+        masters.push_back(m);
+        slaves.push_back(sl);
+    }
+
+    pid_t child = fork();
+    if (child == 0) {
+        for (int sl : slaves) close(sl);
+        run_ok_responder(masters);
+        _exit(0);
+    }
+    for (int m : masters) close(m);
+
+    std::vector<std::unique_ptr<SerialIo>> ios;
+#if HAVE_IO_URING
+    auto loop = std::make_unique<UringLoop>();
+    if (uring && !loop->init()) { std::cerr << "io_uring unavailable: " << strerror(errno) << "\n"; uring = false; }
+    for (int sl : slaves) {
+        if (uring) ios.push_back(std::make_unique<UringIo>(*loop, sl));
+        else if (tcp) ios.push_back(std::make_unique<TcpIo>(sl));
+        else ios.push_back(std::make_unique<PlainIo>(sl));
+    }
+#else
+    if (uring) return res;
+    for (int sl : slaves) {
+        if (tcp) ios.push_back(std::make_unique<TcpIo>(sl));
+        else ios.push_back(std::make_unique<PlainIo>(sl));
+    }
+#endif
+
+    struct rusage ru0, ru1;
+    getrusage(RUSAGE_SELF, &ru0);
+    auto t0 = std::chrono::steady_clock::now();
+    io_syscalls = 0;
+
+    std::vector<int> line(printers, 1);
+    auto send_next = [&](int i) { ios[i]->write(frame_line(line[i], "G1 X" + std::to_string(line[i] % 200) + ".5 Y100.25 E0.0421")); };
+    for (int i = 0; i < printers; ++i) send_next(i);
+
+    int active = printers;
+    bool stalled = false;
+    std::vector<struct pollfd> pfds(printers);
+    while (active > 0 && !stalled) {
+        if (!uring) {
+            for (auto& io : ios) io->flush();   // TcpIo holds writes back until a read
+            for (int i = 0; i < printers; ++i) pfds[i] = { line[i] <= commands ? slaves[i] : -1, POLLIN, 0 };
+            io_syscalls++;
+            if (poll(pfds.data(), pfds.size(), 5000) <= 0) stalled = true;
+        }
+#if HAVE_IO_URING
+        else if (!loop->wait(5000)) stalled = true;
+#endif
+        for (int i = 0; i < printers; ++i) {
+            if (line[i] > commands) continue;
+            if (!uring && !pfds[i].revents) continue;
+            std::string resp = ios[i]->read_line(uring ? 0 : 1000);
+            if (resp.find("ok") == std::string::npos) continue;
+            if (++line[i] <= commands) send_next(i);
+            else active--;
+        }
+    }
+
+    auto t1 = std::chrono::steady_clock::now();
+    getrusage(RUSAGE_SELF, &ru1);
+    long syscalls = io_syscalls;
+
+    ios.clear();
+#if HAVE_IO_URING
+    loop.reset();   // the posted reads hold the ttys open until the ring goes away
+#endif
+    for (int sl : slaves) close(sl);
+    waitpid(child, nullptr, 0);
+    if (stalled) { std::cerr << "Simulated printers stopped answering\n"; return res; }
+
+    auto us = [](const struct timeval& a, const struct timeval& b) { return (b.tv_sec - a.tv_sec) * 1e6 + (b.tv_usec - a.tv_usec); };
+    double cpu_us = us(ru0.ru_utime, ru1.ru_utime) + us(ru0.ru_stime, ru1.ru_stime);
+    double thousands = printers * commands / 1000.0;
+    res.syscalls_per_1k = syscalls / thousands;
+    res.cpu_ms_per_1k = cpu_us / 1000.0 / thousands;
+    res.wall_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    res.ok = true;
+    return res;
+}
+
+int bench_io(int commands) {
+    std::cout << "Round trips of " << commands << " numbered commands per simulated printer\n\n";
+    std::cout << "printers  backend   syscalls/1000 cmds   CPU ms/1000 cmds   wall ms\n";
+    for (int printers : { 1, 8, 32 }) {
+        for (const char* backend : { "plain", "io_uring", "tcp" }) {
+            BenchResult r = bench_backend(backend, printers, commands);
+            if (!r.ok) { std::cout << std::setw(8) << printers << "  " << std::left << std::setw(8) << backend << std::right << "  (unavailable)\n"; continue; }
+            CoutFormat keep;
+            std::cout << std::setw(8) << printers << "  " << std::left << std::setw(8) << backend << std::right
+                      << std::fixed << std::setprecision(1)
+                      << std::setw(21) << r.syscalls_per_1k << std::setw(19) << r.cpu_ms_per_1k
+                      << std::setw(10) << r.wall_ms << "\n";
+        }
+    }
+    return 0;
+}
+
+// 64 MB shaped like a slicer's output: a thumbnail block, a comment header
+// and commented moves
+std::string synthetic_gcode() {
+    std::string chunk = "; thumbnail begin 300x300 45000\n", out;
+    for (int i = 0; i < 600; ++i) chunk += "; iVBORw0KGgoAAAANSUhEUgAAASwAAAEsCAYAAAB5fY51AAAACXBIWXMAAAsTAAALEwEAmpwYAAAg\n";
+    chunk += "; thumbnail end\n;\n";
+    for (int i = 0; i < 200; ++i) chunk += "; setting_" + std::to_string(i) + " = some slicer value\n";
+    for (int i = 0; i < 5000; ++i)
+        chunk += (i % 50 ? "" : ";LAYER_CHANGE\n") + std::string("G1 X") + std::to_string(100 + i % 37) +
+                 ".125 Y" + std::to_string(80 + i % 41) + ".75 E0.04213 ; perimeter\n";
+    while (out.size() < (64u << 20)) out += chunk;
+    return out;
+}
+
+// Runs pass for at least half a second: what it returned and seconds per run
+template <class Pass>
+std::pair<long, double> timed(Pass pass) {
+    long n = 0;
+    int reps = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    double s;
+    do { n = pass(); reps++; s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count(); } while (s < 0.5);
+    return std::make_pair(n, s / reps);
+}
+
+// Lines/s and MB/s of each scanner over a file or synthetic_gcode()
+int bench_scan(const std::string& file) {
+    MappedFile map;
+    std::string synthetic;
+    const char* data;
+    size_t size;
+    if (!file.empty()) {
+        if (!map.open(file)) { std::cerr << "Cannot open " << file << "\n"; return 1; }
+        data = map.data; size = map.size;
+    } else {
+        synthetic = synthetic_gcode();
+        data = synthetic.data(); size = synthetic.size();
+    }
+
+    CoutFormat keep;
+    std::cout << "Scanning " << std::fixed << std::setprecision(1) << size / 1e6 << " MB"
+              << (file.empty() ? " (synthetic: thumbnail, comment header, moves)" : "") << "\n\n"
+              << "scanner         commands        MB/s   Mlines/s\n";
+    long lines = std::count(data, data + size, '\n');
+    auto row = [&](const char* name, std::pair<long, double> r, long expect) {
+        std::cout << std::left << std::setw(14) << name << std::right << std::setw(10) << r.first
+                  << std::setw(12) << size / 1e6 / r.second << std::setw(11) << lines / 1e6 / r.second
+                  << (expect >= 0 && r.first != expect ? "   MISMATCH" : "") << "\n";
+    };
+
+    // What the counting pass did before: getline and trim()
+    std::string copy(data, size);
+    auto base = timed([&] {
+        std::istringstream in(copy);
+        std::string tmp;
+        long n = 0;
+        while (std::getline(in, tmp)) { trim(tmp); if (!tmp.empty() && tmp[0] != ';') n++; }
+        return n;
+    });
+    row("getline+trim", base, -1);
+    for (int i = 0; i < (int)ScanIsa::Count; ++i) {
+        ScanIsa isa = ScanIsa(i);
+        if (!scan_fn(isa)) continue;
+        row(SCAN_ISA_NAMES[i], timed([&] { return count_commands(data, size, isa); }), base.first);
+    }
+    std::cout << "\nBest here: " << SCAN_ISA_NAMES[(int)best_scan_isa()] << "\n";
+    return 0;
+}
+
+// IR size against the text, and re-serialization from the IR against the
+// text path the sender took before it: scan, parse into a batch, print
+int bench_ir(const std::string& file) {
+    MappedFile map;
+    std::string synthetic;
+    const char* data;
+    size_t size;
+    if (!file.empty()) {
+        if (!map.open(file)) { std::cerr << "Cannot open " << file << "\n"; return 1; }
+        data = map.data; size = map.size;
+    } else {
+        synthetic = synthetic_gcode();
+        data = synthetic.data(); size = synthetic.size();
+    }
+
+    auto compiled = timed([&] { return (long)compile_ir(data, size).commands; });
+    GcodeIr ir = compile_ir(data, size);
+    CoutFormat keep;
+    std::cout << std::fixed << std::setprecision(1) << "IR of " << size / 1e6 << " MB"
+              << (file.empty() ? " (synthetic: thumbnail, comment header, moves)" : "") << ": " << ir.commands
+              << " commands, compiled in " << compiled.second * 1e3 << " ms (" << size / 1e6 / compiled.second
+              << " MB/s, " << ir.threads << " thread(s))\n"
+              << "  text " << double(size) / ir.commands << " bytes/command, IR " << ir.bytes_per_command()
+              << " bytes/command (" << 100.0 * ir.bytes_per_command() * ir.commands / size << "%)\n\n"
+              << "re-serialization to text  commands   Mcmd/s   MB/s out\n";
+
+    std::string out;
+    auto row = [&](const char* name, std::pair<long, double> r) {
+        std::cout << std::left << std::setw(24) << name << std::right << std::setw(10) << r.first
+                  << std::setw(9) << r.first / 1e6 / r.second << std::setw(11) << out.size() / 1e6 / r.second
+                  << (r.first != (long)ir.commands ? "   MISMATCH" : "") << "\n";
+    };
+    auto print = [&](CommandBatch& b) {
+        for (size_t i = 0; i < b.size(); ++i) { b.append_text(i, out); out += '\n'; }
+        return (long)b.size();
+    };
+    CommandBatch b;
+    row("text: scan, parse", timed([&] {
+        LineScanner in(data, size);
+        std::string_view cmd;
+        long n = 0;
+        out.clear();
+        for (bool more = true; more; ) {
+            b.clear();
+            while (b.size() < 256 && (more = in.next(cmd))) b.add(strip_framing(cmd), in.line());
+            n += print(b);
+        }
+        return n;
+    }));
+    row("IR: decode", timed([&] {
+        IrReader in(ir);
+        long n = 0;
+        out.clear();
+        while (b.clear(), in.read(b, 256)) n += print(b);
+        return n;
+    }));
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 2 && std::string(argv[1]).find("--ctl=") == 0)
+        return control_client(std::string(argv[1]).substr(6), argc, argv, 2);
+    if (argc >= 3 && std::string(argv[1]) == "--shm-read")
+        return shm_read(argv[2], argc >= 4 ? std::stod(argv[3]) : 0);
+    if (argc >= 2 && std::string(argv[1]) == "--bench-io")
+        return bench_io(argc >= 3 ? std::stoi(argv[2]) : 1000);
+    if (argc >= 2 && std::string(argv[1]) == "--bench-scan")
+        return bench_scan(argc >= 3 ? argv[2] : "");
+    if (argc >= 2 && std::string(argv[1]) == "--bench-ir")
+        return bench_ir(argc >= 3 ? argv[2] : "");
+    if (argc == 4 && std::string(argv[1]) == "--compile") {
+        GcodeIr ir;
+        MachineLimits lim;
+        if (!load_ir(argv[2], ir)) { std::cerr << "Cannot open " << argv[2] << "\n"; return 1; }
+        print_ir_summary(argv[2], ir, lim);
+        if (!ir.save(argv[3])) { std::cerr << "Cannot write " << argv[3] << "\n"; return 1; }
+        std::cout << "Wrote " << argv[3] << "\n";
+        return 0;
+    }
+    // --check needs no printer: "--check file.gcode ... [options]" as well as after device and baud
+    bool offline = argc >= 3 && std::string(argv[1]) == "--check";
+    if (argc < 4 && !offline) { print_help(argv[0]); return 1; }
+
+    std::string dev = offline ? "" : argv[1];
+    int baud = 0;
+    if (!offline && std::from_chars(argv[2], argv[2] + strlen(argv[2]), baud).ec != std::errc()) {
+        std::cerr << "Bad baud rate " << argv[2] << "\n";
+        return 1;
+    }
+    std::vector<std::string> files;
+    std::string queue_dir, between, daemon_sock, io_backend = "plain", metrics_path, shm_name;
+    int idle_poll_s = 10, metrics_interval_s = 15;
+    bool check_only = false, selftest = false, fast_clock = false;
+    SimConfig sim_cfg;
+    Overrides ov;
+    Session s;
+    s.link.max_baud = baud;
+
+    // Transform stages run in the order their options were given
+    auto stage = [&ov](const char* name, bool on) {
+        if (on && std::find(ov.stages.begin(), ov.stages.end(), name) == ov.stages.end()) ov.stages.push_back(name);
+    };
+    for (int i = offline ? 1 : 3; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a == "--debug") ov.debug = true;
+        else if (a.find("--feedrate=") == 0) {
+            int pct = 0;
+            auto [end, ec] = std::from_chars(a.data() + 11, a.data() + a.size(), pct);
+            if (ec != std::errc() || end != a.data() + a.size() || pct < 1 || pct > 1000) {
+                std::cerr << "Bad --feedrate, expected e.g. --feedrate=120 (1 to 1000)\n";
+                return 1;
+            }
+            ov.feedrate_percent = pct;
+            stage("feedrate", true);
+        }
+        else if (a.find("--bed=") == 0) { ov.bed_temp = std::stoi(a.substr(6)); stage("temps", ov.bed_temp >= 0); }
+        else if (a.find("--hotend=") == 0) { ov.hotend_temp = std::stoi(a.substr(9)); stage("temps", ov.hotend_temp >= 0); }
+        else if (a.find("--flow=") == 0 || a.find("--z-offset=") == 0) {
+            bool flow = a[2] == 'f';
+            size_t at = a.find('=') + 1;
+            Decimal& d = flow ? ov.flow_percent : ov.z_offset;
+            // A flow past 1000% could overflow the E × percent product
+            if (!parse_decimal(a.data() + at, a.data() + a.size(), d) || d.decimals > 3 ||
+                (flow && (d.mant < pow10(d.decimals) || d.mant > 1000 * pow10(d.decimals)))) {
+                std::cerr << "Bad " << a.substr(0, at - 1) << ", expected e.g. " << (flow ? "--flow=95 (1 to 1000)" : "--z-offset=-0.05") << "\n";
+                return 1;
+            }
+            stage(flow ? "flow" : "z-offset", d.mant != 0);
+        }
+        else if (a.find("--window=") == 0) ov.window = std::max(1, std::stoi(a.substr(9)));
+        else if (a.find("--temp-poll=") == 0) ov.temp_poll_s = std::stoi(a.substr(12));
+        else if (a == "--heat-settle") ov.heat_settle = 3;
+        else if (a.find("--heat-settle=") == 0) ov.heat_settle = std::stod(a.substr(14));
+        else if (a.find("--temp-log=") == 0) ov.temp_log = a.substr(11);
+        else if (a == "--jitter") ov.jitter_ms = 50;
+        else if (a.find("--jitter=") == 0) ov.jitter_ms = std::stod(a.substr(9));
+        else if (a == "--auto-baud") s.link.auto_baud = true;
+        else if (a.find("--link-window=") == 0) s.link.window_s = std::stoi(a.substr(14));
+        else if (a.find("--link-errors=") == 0) s.link.max_errors = std::stoi(a.substr(14));
+        else if (a.find("--link-clean=") == 0) s.link.clean_s = std::stoi(a.substr(13));
+        else if (a.find("--queue-dir=") == 0) queue_dir = a.substr(12);
+        else if (a.find("--between=") == 0) between = a.substr(10);
+        else if (a.find("--daemon=") == 0) daemon_sock = a.substr(9);
+        else if (a.find("--io=") == 0) io_backend = a.substr(5);
+        else if (a.find("--metrics=") == 0) metrics_path = a.substr(10);
+        else if (a.find("--metrics-interval=") == 0) metrics_interval_s = std::stoi(a.substr(19));
+        else if (a.find("--shm=") == 0) shm_name = a.substr(6);
+        else if (a.find("--rt=") == 0) s.rt.priority = std::stoi(a.substr(5));
+        else if (a.find("--cpus=") == 0) s.rt.cpus = parse_cpu_list(a.substr(7));
+        else if (a.find("--aux-cpus=") == 0) s.rt.aux_cpus = parse_cpu_list(a.substr(11));
+        else if (a == "--preflight") ov.preflight = true;
+        else if (a == "--check") check_only = true;
+        else if (a == "--selftest") selftest = true;
+        else if (a.find("--sim-bufsize=") == 0) sim_cfg.bufsize = std::max(1, std::stoi(a.substr(14)));
+        else if (a.find("--sim-blocks=") == 0) sim_cfg.blocks = std::max(2, std::stoi(a.substr(13)));
+        else if (a == "--fast-clock") fast_clock = true;
+        else if (a == "--fast-start") ov.fast_start = 50;
+        else if (a.find("--fast-start=") == 0) ov.fast_start = std::stoi(a.substr(13));
+        else if (a == "--stored-mesh") ov.stored_mesh = true;
+        else if (a.find("--park=") == 0) {
+            if (sscanf(a.c_str() + 7, "%lf,%lf,%lf", &ov.park[0], &ov.park[1], &ov.park[2]) < 2) {
+                std::cerr << "Bad --park, expected e.g. 0,220,10\n"; return 1;
+            }
+        }
+        else if (a.find("--pause-retract=") == 0) ov.pause_retract = std::max(0.0, std::stod(a.substr(16)));
+        else if (a == "--dedupe") stage("dedupe", true);
+        else if (a.find("--volume=") == 0) {
+            if (sscanf(a.c_str() + 9, "%lfx%lfx%lf", &ov.limits.max[0], &ov.limits.max[1], &ov.limits.max[2]) != 3) {
+                std::cerr << "Bad --volume, expected e.g. 235x235x250\n"; return 1;
+            }
+        }
+        else if (a.find("--idle-poll=") == 0) idle_poll_s = std::max(1, std::stoi(a.substr(12)));
+        else if (a == "--help") { print_help(argv[0]); return 0; }
+        else if (a.find("--") != 0) files.push_back(a);
+    }
+    if (files.empty() && queue_dir.empty() && daemon_sock.empty() && !selftest) { print_help(argv[0]); return 1; }
+    if (check_only) {
+        int bad = 0;
+        for (const auto& file : files) {
+            GcodeIr ir;
+            if (!load_ir(file, ir)) { std::cerr << "Cannot open " << file << "\n"; bad++; continue; }
+            print_ir_summary(file, ir, ov.limits);
+            bad += !print_preflight(file, preflight(ir, ov, ov.limits));
+        }
+        return bad ? 1 : 0;
+    }
+
+    if (fast_clock && dev != "sim") { std::cerr << "--fast-clock needs \"sim\" as the device\n"; return 1; }
+    s.transport = transport_of(dev);
+    pid_t sim = dev == "sim" && !fast_clock ? start_simulator(dev, baud, sim_cfg) : 0;
+    if (sim < 0) return 1;
+    VirtualClock virtual_clock;
+    std::unique_ptr<SimPrinter> fast_sim;
+    auto real_start = std::chrono::steady_clock::now();
+    // The simulator reports once the port is closed; wait for that before exiting
+    auto disconnect = [&] {
+        std::cout.flush();
+        close(s.fd);
+        if (sim > 0 && io_syscalls == 0) kill(sim, SIGTERM);   // it may never have seen the port open
+        if (sim > 0) waitpid(sim, nullptr, 0);
+        if (fast_sim) {
+            fast_sim->report();
+            CoutFormat keep;
+            std::cout << "  simulated in " << std::fixed << std::setprecision(2)
+                      << std::chrono::duration<double>(std::chrono::steady_clock::now() - real_start).count()
+                      << " s of real time\n";
+        }
+    };
+
+    std::unique_ptr<SerialIo> io;
+    if (fast_clock) {
+        host_clock = &virtual_clock;
+        fast_sim = std::make_unique<SimPrinter>(-1, baud, sim_cfg);
+        io = std::make_unique<SimIo>(*fast_sim, virtual_clock);
+    } else if (s.transport == Transport::Null) {
+        io = std::make_unique<NullIo>();
+    } else {
+        s.fd = open_transport(dev, baud, s.transport);
+        if (s.fd < 0) { disconnect(); return 1; }
+    }
+    s.baud = baud;
+    if (s.link.auto_baud && !has_baud(s.transport)) {
+        std::cerr << "--auto-baud needs a serial port — off over " << TRANSPORT_NAMES[int(s.transport)] << "\n";
+        s.link.auto_baud = false;
+    }
+
+#if HAVE_IO_URING
+    UringLoop uring;
+    if (!io && io_backend == "uring") {
+        if (uring.init()) io = std::make_unique<UringIo>(uring, s.fd);
+        else std::cerr << "io_uring unavailable (" << strerror(errno) << ") — using read/write\n";
+    }
+#endif
+    if (!io && s.transport == Transport::Tcp) io = std::make_unique<TcpIo>(s.fd);
+    if (!io) io = std::make_unique<PlainIo>(s.fd);
+    s.io = io.get();
+    if (s.transport == Transport::Serial) host_clock->sleep_for(std::chrono::seconds(2));   // Marlin reboots on DTR
+
+    std::cout << "Connected to " << dev;
+    if (has_baud(s.transport)) std::cout << " @ " << baud << " baud";
+    std::cout << " (" << TRANSPORT_NAMES[int(s.transport)] << ")\n";
+    if (ov.feedrate_percent > 0) std::cout << "  Feedrate × " << ov.feedrate_percent << "%\n";
+    if (ov.bed_temp >= 0)        std::cout << "  Bed forced → " << ov.bed_temp << "°C\n";
+    if (ov.hotend_temp >= 0)     std::cout << "  Hotend forced → " << ov.hotend_temp << "°C\n";
+    if (ov.flow_percent.mant > 0) { std::string f; append_decimal(f, ov.flow_percent); std::cout << "  Flow × " << f << "%\n"; }
+    if (ov.z_offset.mant != 0)    { std::string z; append_decimal(z, ov.z_offset); std::cout << "  Z offset " << z << " mm\n"; }
+    if (ov.stages.size() > 1) {
+        std::cout << "  Pipeline: ";
+        for (size_t i = 0; i < ov.stages.size(); ++i) std::cout << (i ? " → " : "") << ov.stages[i];
+        std::cout << "\n";
+    }
+    std::cout << "\n";
+
+    enter_realtime(s.rt);
+    std::unique_ptr<LatencyProbe> probe;
+    if (s.rt.priority > 0) { probe = std::make_unique<LatencyProbe>(s.rt); s.probe = probe.get(); }
+    s.metrics.baud = s.baud;
+    std::unique_ptr<MetricsExporter> exporter;
+    if (!metrics_path.empty()) exporter = std::make_unique<MetricsExporter>(metrics_path, metrics_interval_s, dev, s);
+    pause_flag = &s.pause;
+    cancel_flag = &s.cancel;
+    struct sigaction sa{};
+    sa.sa_handler = on_pause_signal;
+    sa.sa_flags = SA_RESTART;
+    for (int sig : { SIGUSR1, SIGUSR2, SIGTSTP }) sigaction(sig, &sa, nullptr);
+    sa.sa_handler = on_cancel_signal;
+    sa.sa_flags = SA_RESTART | SA_RESETHAND;   // a second Ctrl-C kills
+    for (int sig : { SIGINT, SIGTERM }) sigaction(sig, &sa, nullptr);
+    StatusPublisher status;
+    if (!shm_name.empty()) {
+        if (!status.open(shm_name)) { std::cerr << "Cannot create status segment " << shm_name << ": " << strerror(errno) << "\n"; disconnect(); return 1; }
+        s.status = &status;
+        status.publish(s, 0);
+    }
+
+    if (selftest) {
+        int rc = run_selftest(s, std::max(ov.window, 4), ov.debug);
+        disconnect();
+        return rc;
+    }
+    if (!daemon_sock.empty()) {
+        int rc = run_daemon(s, daemon_sock, files, between, idle_poll_s, ov);
+        disconnect();
+        return rc;
+    }
+
+    std::set<std::string> done;
+    int jobs = 0, failed = 0;
+    bool link_lost = false;
+    for (size_t next = 0; !link_lost; ) {
+        std::string file;
+        if (next < files.size()) file = files[next++];
+        else if (!queue_dir.empty()) {
+            auto queued = scan_queue_dir(queue_dir, done);
+            if (queued.empty()) break;
+            file = queued.front();
+        }
+        else break;
+        done.insert(file);
+
+        if (jobs > 0 && !between.empty()) {
+            std::cout << "\nRunning between-job G-code " << between << "\n";
+            if (stream_job(s, between, ov, true) == JobResult::LinkLost) { link_lost = true; break; }
+        }
+        if (jobs > 0) std::cout << "\n";
+        jobs++;
+
+        JobResult r = stream_job(s, file, ov);
+        if (r != JobResult::Done) failed++;
+        if (r == JobResult::LinkLost) link_lost = true;
+        if (cancel_signalled) break;
+    }
+
+    if (jobs > 1) std::cout << "\nSession: " << jobs - failed << "/" << jobs << " jobs completed on one connection\n";
+    if (s.link.resends || s.link.checksum || s.link.line_number || s.link.timeouts)
+        std::cout << "Link: " << s.link.resends << " resends, " << s.link.checksum << " checksum errors, "
+                  << s.link.line_number << " line-number errors, " << s.link.timeouts << " timeouts, "
+                  << s.link.step_downs << " step-downs, " << s.link.step_ups << " step-ups (ended at " << s.baud << " baud)\n";
+    disconnect();
+    return failed ? 1 : 0;
 }